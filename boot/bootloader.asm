@@ -60,6 +60,10 @@ KERNEL_OFFSET equ 0x9100
     push bx
     call print_string_with_newline
 
+    ; BIOS services are gone once we switch to protected mode, so grab
+    ; the physical memory map for the kernel now
+    call detect_memory
+
     ; place to load our kernel
     mov bx, KERNEL_OFFSET 
     push bx
@@ -94,6 +98,7 @@ KERNEL_OFFSET equ 0x9100
 %include "print_string.asm"
 %include "kernel_size.asm"
 %include "switch_to_32bit.asm"
+%include "detect_memory.asm"
 
 
 [bits 32]
@@ -101,6 +106,7 @@ BEGIN_PM: ; after the switch we will get here
     mov ebx, MSG_PROT_MODE
     push ebx
     call print_string_pm ; Note that this will be written at the top left corner
+    push E820_MAP        ; main() gets the memory map as its argument
     call KERNEL_OFFSET
     jmp $
 
@@ -0,0 +1,51 @@
+; KalioOS (C) 2020 Pranav Bagur
+
+; Ask the BIOS for the physical memory map (INT 0x15, EAX = 0xE820)
+;
+; Every call returns one 24 byte entry (base, length, type, ACPI attributes)
+; and a continuation value in EBX. EBX = 0 (or carry set) means that was the
+; last entry. The entries are stored at E820_MAP in the layout of e820_map_t
+; (see mm/if/memory.h):
+;
+;   E820_MAP     - dd number of entries
+;   E820_MAP + 4 - dd reserved
+;   E820_MAP + 8 - entries
+;
+; If the BIOS does not support E820 the count stays 0 and the kernel falls
+; back to its default memory size
+E820_MAP     equ 0x500
+E820_ENTRIES equ E820_MAP + 8
+E820_MAX     equ 32
+E820_SMAP    equ 0x534D4150 ; 'SMAP'
+
+detect_memory:
+  pushad
+  xor ax, ax
+  mov es, ax
+  mov dword [E820_MAP], 0
+  mov di, E820_ENTRIES
+  xor ebx, ebx
+
+.next_entry:
+  mov eax, 0xE820
+  mov edx, E820_SMAP
+  mov ecx, 24
+  mov dword [es:di + 20], 1 ; valid ACPI 3.x attributes if the BIOS skips them
+  int 0x15
+  jc .done                  ; carry is set past the last entry
+  cmp eax, E820_SMAP
+  jne .done
+  jcxz .skip_entry          ; nothing was returned
+
+  inc dword [E820_MAP]
+  add di, 24
+  cmp dword [E820_MAP], E820_MAX
+  je .done
+
+.skip_entry:
+  test ebx, ebx
+  jnz .next_entry
+
+.done:
+  popad
+  ret
@@ -0,0 +1,160 @@
+/* KalioOS (C) 2020 Pranav Bagur */
+
+#include "if/cpu.h"
+#include "if/common.h"
+
+/* --------------------------------------------------------------------------
+                         Constants and types
+   -------------------------------------------------------------------------- */
+cpu_info_t cpu_glob;
+
+/* --------------------------------------------------------------------------
+                         Static inline functions
+   -------------------------------------------------------------------------- */
+/* === SIF: Can we flip the ID bit of EFLAGS (i.e is CPUID supported)? === */
+static inline bool
+cpuid_supported(void)
+{
+  ub4 before;
+  ub4 after;
+
+  asm volatile("pushfl; pop %0; mov %0, %1; xor %2, %1;"
+               "push %1; popfl; pushfl; pop %1; push %0; popfl;"
+               : "=&r" (before), "=&r" (after) : "i" (EFLAGS_ID));
+
+  return !!((before ^ after) & EFLAGS_ID);
+}
+
+/* --------------------------------------------------------------------------
+                         Static functions
+   -------------------------------------------------------------------------- */
+/*
+ * SF: enable_sse - let the kernel use SSE instructions
+ *
+ * ARGS :-
+ *
+ * Clears CR0.EM, sets CR0.MP and tells the CPU (CR4) that we know about
+ * FXSAVE and SIMD exceptions
+ *
+ * RET
+ */
+static void
+enable_sse(void)
+{
+  ub4 cr0;
+
+  asm volatile("mov %%cr0, %0" : "=r" (cr0));
+  cr0 &= ~CR0_EM;
+  cr0 |= CR0_MP;
+  asm volatile("mov %0, %%cr0" :: "r" (cr0));
+
+  cpu_set_cr4(CR4_OSFXSR | CR4_OSXMMEXCPT);
+}
+
+/* --------------------------------------------------------------------------
+                         Export functions
+   -------------------------------------------------------------------------- */
+/*
+ * EF: cpuid - execute CPUID
+ *
+ * ARGS :-
+ *   leaf - CPUID leaf (eax)
+ *   eax, ebx, ecx, edx - registers returned by CPUID
+ *
+ * RET
+ */
+void
+cpuid(ub4 leaf, ub4 *eax, ub4 *ebx, ub4 *ecx, ub4 *edx)
+{
+  asm volatile("cpuid"
+               : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+               : "a" (leaf), "c" (0));
+}
+
+/*
+ * EF: cpu_has - check CPUID leaf 1 EDX features
+ *
+ * ARGS :-
+ *   mask - CPUID_EDX_* bits
+ *
+ * RET
+ *   true iff every feature in mask is present
+ */
+bool
+cpu_has(ub4 mask)
+{
+  return ((cpu_glob.edx_cpu & mask) == mask);
+}
+
+/*
+ * EF: cpu_set_cr4 - set bits in CR4
+ *
+ * ARGS :-
+ *   bits - CR4_* bits to set
+ *
+ * RET
+ */
+void
+cpu_set_cr4(ub4 bits)
+{
+  ub4 cr4;
+
+  asm volatile("mov %%cr4, %0" : "=r" (cr4));
+  cr4 |= bits;
+  asm volatile("mov %0, %%cr4" :: "r" (cr4) : "memory");
+}
+
+/*
+ * EF: cpu_sse_enabled - are SSE/SSE2 instructions usable?
+ *
+ * ARGS :-
+ *
+ * RET
+ *   true iff SSE2 is present and has been enabled
+ */
+bool
+cpu_sse_enabled(void)
+{
+  return cpu_glob.sse_cpu;
+}
+
+/*
+ * EF: cpu_init_func - module init function
+ *
+ * ARGS :-
+ *
+ * RET - TRUE iff successful
+ */
+bool
+cpu_init_func(void)
+{
+  ub4 eax;
+  ub4 ebx;
+
+  cpu_glob.cpuid_cpu = cpuid_supported();
+  if (cpu_glob.cpuid_cpu) {
+    cpuid(0, &cpu_glob.max_leaf_cpu, &ebx, &eax, &eax);
+    if (cpu_glob.max_leaf_cpu >= 1)
+      cpuid(1, &eax, &ebx, &cpu_glob.ecx_cpu, &cpu_glob.edx_cpu);
+  }
+
+  if (cpu_has(CPUID_EDX_FXSR | CPUID_EDX_SSE | CPUID_EDX_SSE2)) {
+    enable_sse();
+    cpu_glob.sse_cpu = true;
+  }
+
+  printk_system("Initialized cpu features..");
+  return true;
+}
+
+/*
+ * EF: cpu_exit_func - module exit function
+ *
+ * ARGS :-
+ *
+ * RET
+ */
+void
+cpu_exit_func(void)
+{
+}
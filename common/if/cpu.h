@@ -0,0 +1,106 @@
+/* KalioOS (C) 2020 Pranav Bagur */
+
+/*
+ * CPU feature detection
+ *
+ * The features we care about are reported by CPUID leaf 1. CPUs older than
+ * the late 486s have no CPUID at all, which is detected by trying to flip the
+ * ID bit of EFLAGS. Such a CPU simply reports no features.
+ */
+#ifndef __CPU_H
+#define __CPU_H
+
+#include "types.h"
+
+/* --------------------------------------------------------------------------
+                         Constants and types
+   -------------------------------------------------------------------------- */
+#define NR_CPUS          1       /* no SMP yet, see cpu_id */
+
+#define EFLAGS_IF        0x200
+#define EFLAGS_ID        0x200000
+
+/* CPUID leaf 1 EDX */
+#define CPUID_EDX_PSE    (1 << 3)
+#define CPUID_EDX_TSC    (1 << 4)
+#define CPUID_EDX_PGE    (1 << 13)
+#define CPUID_EDX_FXSR   (1 << 24)
+#define CPUID_EDX_SSE    (1 << 25)
+#define CPUID_EDX_SSE2   (1 << 26)
+
+#define FXSAVE_SIZE      512     /* fxsave area, 16 byte aligned */
+
+#define CR0_MP           (1 << 1)
+#define CR0_EM           (1 << 2)
+#define CR4_PSE          (1 << 4)
+#define CR4_PGE          (1 << 7)
+#define CR4_OSFXSR       (1 << 9)
+#define CR4_OSXMMEXCPT   (1 << 10)
+
+/* STRUCT cpu_info_t - What we know about the CPU */
+typedef struct _cpu_info
+{
+  bool      cpuid_cpu;         /* CPUID is supported           */
+  ub4       max_leaf_cpu;
+  ub4       edx_cpu;           /* CPUID leaf 1 feature flags   */
+  ub4       ecx_cpu;
+  bool      sse_cpu;           /* SSE/SSE2 enabled in CR0/CR4  */
+} cpu_info_t;
+
+/* --------------------------------------------------------------------------
+                         Static inline functions
+   -------------------------------------------------------------------------- */
+/* === SIF: Index of the CPU we are running on (< NR_CPUS) === */
+static inline ub4
+cpu_id(void)
+{
+  return 0;
+}
+
+/* === SIF: Save the x87/SSE registers (needs CR4_OSFXSR) === */
+static inline void
+fxsave(ub1 *area)
+{
+  asm volatile("fxsave (%0)" :: "r" (area) : "memory");
+}
+
+/* === SIF: Restore the x87/SSE registers saved by fxsave === */
+static inline void
+fxrstor(ub1 *area)
+{
+  asm volatile("fxrstor (%0)" :: "r" (area) : "memory");
+}
+
+/* === SIF: Read the time stamp counter (needs CPUID_EDX_TSC) === */
+static inline ub8
+rdtsc(void)
+{
+  ub4 lo;
+  ub4 hi;
+
+  asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((ub8)hi << 32) | lo;
+}
+
+/* --------------------------------------------------------------------------
+                         Export function declarations
+   -------------------------------------------------------------------------- */
+/* execute CPUID for leaf */
+void cpuid(ub4 leaf, ub4 *eax, ub4 *ebx, ub4 *ecx, ub4 *edx);
+
+/* does the CPU have all the CPUID_EDX_* features in mask? */
+bool cpu_has(ub4 mask);
+
+/* set bits in CR4 */
+void cpu_set_cr4(ub4 bits);
+
+/* are SSE/SSE2 instructions usable? */
+bool cpu_sse_enabled(void);
+
+/* module init function   */
+bool cpu_init_func(void);
+
+/* module exit function   */
+void cpu_exit_func(void);
+
+#endif
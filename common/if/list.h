@@ -39,6 +39,9 @@ void list_add_tail(list *head, list *cur);
 /* add element to list (head) */
 void list_add_head(list *head, list *cur);
 
+/* add element in front of pos (pos must be on the list) */
+void list_add_before(list *pos, list *cur);
+
 /* remove element from list */
 void list_remove(list *head, list *cur);
 
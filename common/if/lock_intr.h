@@ -16,9 +16,9 @@
    -------------------------------------------------------------------------- */ 
 /* Synchronize with the interrupt context */
 
-/* Disable interrupts  */
+/* Disable interrupts, saving their state in flags */
 bool lock_intr(ub8 *flags);
 
-/* Enable interrupts  */
+/* Restore interrupts from flags */
 void unlock_intr(ub8 *flags);
 #endif
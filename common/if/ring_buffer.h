@@ -6,10 +6,14 @@
 #include "types.h"
 #include "../../mm/if/memory.h"
 #include "../../mm/if/heap.h"
+#include "../../mm/if/vma.h"
 
 /* -------------------------------------------------------------------------- 
                          Constants and types
    -------------------------------------------------------------------------- */ 
+/* Buffers this big are reserved lazily (see vm_reserve) */
+#define RB_RESERVE_MIN  (4 * PAGE_SIZE)
+
 typedef struct _ring_buf
 {
   ub4   size;
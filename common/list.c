@@ -52,10 +52,30 @@ void list_add_head(list *head, list *cur)
   cur->next        = head->next;
   if (cur->next)
     cur->next->prev  = cur;
+  else
+    head->prev       = cur;
   cur->prev        = head;
   head->next       = cur;
 }
 
+/* 
+ * EF: list_add_before - add element in front of another one
+ * 
+ * ARGS :-
+ *   pos  - item on the list (its prev is the head if it is the first one)
+ *   cur  - item to be added
+ *
+ * RET -
+ */
+void
+list_add_before(list *pos, list *cur)
+{
+  cur->next       = pos;
+  cur->prev       = pos->prev;
+  pos->prev->next = cur;
+  pos->prev       = cur;
+}
+
 /* 
  * EF: list_remove - remove element from the list
  * 
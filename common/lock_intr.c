@@ -2,33 +2,31 @@
 
 #include "if/lock_intr.h"
 #include "if/common.h"
+#include "if/cpu.h"
 
-/* === SIF: Disable interrupts === */
-inline ub8 disable_intr()
+/* === SIF: Disable interrupts, return the EFLAGS they were disabled in === */
+inline ub4 disable_intr()
 {
-  ub8 flags;
-  asm volatile("pushfl; pop %0; cli;" : "=g" (flags));
+  ub4 flags;
+  asm volatile("pushfl; popl %0; cli;" : "=r" (flags) :: "memory");
 
   return flags;
 }
 
-/* === SIF: Enable interrupts === */
-inline ub8 enable_intr()
+/* === SIF: Put back the EFLAGS saved by disable_intr === */
+inline void enable_intr(ub4 flags)
 {
-  ub8 flags;
-
-  asm volatile("push %0; popfl; sti;" :: "g" (flags));
-  return flags;
+  asm volatile("pushl %0; popfl;" :: "r" (flags) : "memory", "cc");
 }
 
 /* === SIF: Check if interrupts are enabled === */
 inline bool 
 interrupts_enabled()
 {
-  ub8 flags;
+  ub4 flags;
 
-  asm volatile("pushfl; pop %0;" : "=g" (flags));
-  return !!(flags & 0x200);
+  asm volatile("pushfl; popl %0;" : "=r" (flags));
+  return !!(flags & EFLAGS_IF);
 }
 
 /* -------------------------------------------------------------------------- 
@@ -38,26 +36,26 @@ interrupts_enabled()
  * EF: lock_intr - disable interrupts
  * 
  * ARGS :-
- *   flags - see disable_intr above
+ *   flags - where the current EFLAGS are saved for unlock_intr
+ *
+ * Nests: the matching unlock_intr only enables interrupts again if they
+ * were enabled here, so this is safe in an interrupt handler too
  *
  * RET -
- *   TRUE  - iff interrupts are not already disabled
+ *   TRUE  - iff interrupts were enabled
  *   FALSE - otherwise
  */
 bool lock_intr(ub8 *flags)
 {
-  if (!interrupts_enabled())
-    return false;
-
   *flags = disable_intr();
-  return true;
+  return !!(*flags & EFLAGS_IF);
 }
 
 /* 
- * EF: unlock_intr - enable interrupts
+ * EF: unlock_intr - restore interrupts to how lock_intr found them
  * 
  * ARGS :-
- *   flags - see enable_intr above
+ *   flags - filled by lock_intr
  *
  * RET -
  */
@@ -68,5 +66,5 @@ unlock_intr(ub8 *flags)
     PANIC("INTR ENABLED");
   }
 
-  *flags = enable_intr();
+  enable_intr((ub4)*flags);
 }
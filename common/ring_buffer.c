@@ -125,11 +125,16 @@ rb_init(ub4 size, ub4 capacity)
 {
   ring_buf *rb;
 
-  rb = (ring_buf *)kmalloc_heap(sizeof(*rb));
+  rb = (ring_buf *)kmalloc_heap_flags(sizeof(*rb), HEAP_NOZERO);
   if (!rb)
     return NULL;
   else {
-    rb->buf      = (void *)kmalloc_heap(size * capacity);
+    /* A big buffer costs nothing until it actually fills up */
+    if (size * capacity >= RB_RESERVE_MIN)
+      rb->buf    = (void *)vm_reserve(size * capacity);
+    else
+      rb->buf    = (void *)kmalloc_heap_flags(size * capacity, HEAP_NOZERO);
+
     if (!rb->buf)
       goto err_exit;
 
@@ -158,6 +163,10 @@ err_exit:
 void
 rb_free(ring_buf *rb)
 {
-  kfree_heap((ub4 *)rb->buf);
+  if (IS_VMALLOC_ADDR(rb->buf))
+    vm_release((ub4)rb->buf);
+  else
+    kfree_heap((ub4 *)rb->buf);
+
   kfree_heap((ub4 *)rb);
 }
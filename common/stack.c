@@ -2,6 +2,14 @@
 
 #include "if/common.h"
 #include "if/stack.h"
+#include "../mm/if/heap.h"
+#include "../mm/if/slab.h"
+
+/* --------------------------------------------------------------------------
+                         Constants and types
+   -------------------------------------------------------------------------- */
+/* Created by the first stack_init */
+kmem_cache_t *stack_item_cache;
 
 /* --------------------------------------------------------------------------
                          Export functions
@@ -36,7 +44,7 @@ stack_push(stack_t *stack, void *val)
 {
   stack_item_t *item;
 
-  item = (stack_item_t *)kmalloc_heap(sizeof(*item));
+  item = (stack_item_t *)kmem_cache_alloc(stack_item_cache);
   if (!item)
     return false;
   else {
@@ -74,7 +82,7 @@ stack_pop(stack_t *stack)
     stack_item = list_entry(item, stack_item_t, link_stack_item);
     val = stack_item->val_stack_item;
 
-    kfree_heap((ub4 *)stack_item);
+    kmem_cache_free(stack_item_cache, stack_item);
   }
 
   return val;
@@ -92,11 +100,17 @@ stack_init()
 {
   stack_t *stack;
 
-  stack = (stack_t *)kmalloc_heap(sizeof(*stack));
+  if (!stack_item_cache) {
+    stack_item_cache = kmem_cache_create("stack_item", sizeof(stack_item_t),
+                                         0, NULL);
+    if (!stack_item_cache)
+      return NULL;
+  }
+
+  stack = (stack_t *)kmalloc_heap_flags(sizeof(*stack), HEAP_NOZERO);
   if (!stack)
     return NULL;
   else {
-    //memset((ub1 *)stack, sizeof(*stack), 0);
     stack->count_stack = 0;
     list_init(&stack->list_stack);
   }
@@ -0,0 +1,246 @@
+/* KalioOS (C) 2020 Pranav Bagur */
+
+#include "if/clock.h"
+#include "if/port.h"
+#include "if/screen.h"
+#include "../common/if/cpu.h"
+#include "../common/if/lock_intr.h"
+
+clocksource_t clock_glob;
+
+/* --------------------------------------------------------------------------
+                         Static inline functions
+   -------------------------------------------------------------------------- */
+/* === SIF: 64 by 32 bit division, there is no libgcc to do it for us === */
+static inline ub8
+div_u64_u32(ub8 n, ub4 d, ub4 *rem)
+{
+  ub4 q_hi = (ub4)(n >> 32) / d;
+  ub4 r    = (ub4)(n >> 32) % d;
+  ub4 q_lo;
+
+  /* r < d, so the quotient of r:lo fits in 32 bits */
+  asm("divl %4" : "=a" (q_lo), "=d" (r) : "a" ((ub4)n), "d" (r), "rm" (d));
+  if (rem)
+    *rem = r;
+
+  return ((ub8)q_hi << 32) | q_lo;
+}
+
+/* === SIF: (n * mult) >> shift without losing the top bits, shift <= 32 === */
+static inline ub8
+mul_u64_u32_shr(ub8 n, ub4 mult, ub4 shift)
+{
+  ub8 lo = ((ub8)(ub4)n * mult) >> shift;
+  ub8 hi = (ub8)(ub4)(n >> 32) * mult;
+
+  return lo + (shift ? hi << (32 - shift) : hi << 32);
+}
+
+/* --------------------------------------------------------------------------
+                         Static functions
+   -------------------------------------------------------------------------- */
+/*
+ * SF: read_tsc - tsc clocksource counter
+ *
+ * ARGS :-
+ *
+ * RET
+ *   time stamp counter
+ */
+static ub8
+read_tsc(void)
+{
+  return rdtsc();
+}
+
+/*
+ * SF: read_ticks - fallback clocksource counter
+ *
+ * ARGS :-
+ *
+ * RET
+ *   ticks, read in one piece
+ */
+static ub8
+read_ticks(void)
+{
+  ub8 flags;
+  ub8 now;
+
+  lock_intr(&flags);
+  now = ticks;
+  unlock_intr(&flags);
+
+  return now;
+}
+
+/*
+ * SF: calibrate_tsc - time CLOCK_CAL_COUNT PIT counts with the TSC
+ *
+ * ARGS :-
+ *
+ * Channel 2 counts down with its gate up and raises OUT at zero. It is not
+ * wired to an interrupt, so we just spin on OUT. Interrupts are off so that
+ * nothing gets between OUT going up and reading the TSC
+ *
+ * RET
+ *   TSC cycles in CLOCK_CAL_NS, 0 if channel 2 never finished
+ */
+static ub8
+calibrate_tsc(void)
+{
+  ub8 flags;
+  ub8 start;
+  ub8 end    = 0;
+  ub4 spins;
+  ub1 port;
+
+  lock_intr(&flags);
+
+  /* Gate up, speaker off */
+  port = port_byte_in(PIT_CH2_PORT);
+  port_byte_out(PIT_CH2_PORT, (port & ~PIT_CH2_SPEAKER) | PIT_CH2_GATE);
+
+  port_byte_out(PIT_CMD, PIT_CH2_CMD);
+  port_byte_out(PIT_CH2_DATA, (ub1)(CLOCK_CAL_COUNT & 0xFF));
+  port_byte_out(PIT_CH2_DATA, (ub1)((CLOCK_CAL_COUNT >> 8) & 0xFF));
+  start = rdtsc();
+
+  for (spins = 0; spins < CLOCK_CAL_SPINS; spins++) {
+    if (port_byte_in(PIT_CH2_PORT) & PIT_CH2_OUT) {
+      end = rdtsc();
+      break;
+    }
+  }
+
+  port_byte_out(PIT_CH2_PORT, port);
+  unlock_intr(&flags);
+
+  return end ? end - start : 0;
+}
+
+/* --------------------------------------------------------------------------
+                         Export functions
+   -------------------------------------------------------------------------- */
+/*
+ * EF: ktime_get_ns - nanoseconds since boot
+ *
+ * ARGS :-
+ *
+ * RET
+ *   ns since clock_init_func, at the resolution of the clocksource
+ */
+ub8
+ktime_get_ns(void)
+{
+  ub8 count = clock_glob.read_clock() - clock_glob.base_clock;
+
+  return mul_u64_u32_shr(count, clock_glob.mult_clock,
+                         clock_glob.shift_clock);
+}
+
+/*
+ * EF: ns_to_ticks - ticks a delay takes
+ *
+ * ARGS :-
+ *   ns - delay
+ *
+ * RET
+ *   ticks, rounded up so a timer never fires early
+ */
+ub8
+ns_to_ticks(ub8 ns)
+{
+  ub4 rem;
+  ub8 nticks = div_u64_u32(ns, NSEC_PER_TICK, &rem);
+
+  return rem ? nticks + 1 : nticks;
+}
+
+/*
+ * EF: ticks_to_ns - nanoseconds in a number of ticks
+ *
+ * ARGS :-
+ *   nticks - # ticks
+ *
+ * RET
+ *   ns
+ */
+ub8
+ticks_to_ns(ub8 nticks)
+{
+  return mul_u64_u32_shr(nticks, NSEC_PER_TICK, 0);
+}
+
+/*
+ * EF: clock_name - clocksource in use
+ *
+ * ARGS :-
+ *   khz - filled with the counter rate, may be NULL
+ *
+ * RET
+ *   name of the clocksource
+ */
+ub1 *
+clock_name(ub4 *khz)
+{
+  if (khz)
+    *khz = clock_glob.khz_clock;
+
+  return clock_glob.name_clock;
+}
+
+/*
+ * EF: clock_init_func - clock init function
+ *
+ * ARGS :-
+ *
+ * Falls back to ticks without a TSC, or if calibration fails
+ *
+ * RET - TRUE
+ */
+bool
+clock_init_func(void)
+{
+  ub8 cycles = 0;
+
+  if (cpu_has(CPUID_EDX_TSC))
+    cycles = calibrate_tsc();
+
+  /* mult has to fit in 32 bits, anything this slow is not a real TSC */
+  if (cycles > ((CLOCK_CAL_NS << CLOCK_TSC_SHIFT) >> 32) &&
+      !(cycles >> 32)) {
+    clock_glob.name_clock  = "tsc";
+    clock_glob.read_clock  = read_tsc;
+    clock_glob.shift_clock = CLOCK_TSC_SHIFT;
+    clock_glob.mult_clock  = (ub4)div_u64_u32(CLOCK_CAL_NS << CLOCK_TSC_SHIFT,
+                                              (ub4)cycles, NULL);
+    clock_glob.khz_clock   = (ub4)div_u64_u32(cycles,
+                                              CLOCK_CAL_NS / 1000000, NULL);
+  }
+  else {
+    clock_glob.name_clock  = "ticks";
+    clock_glob.read_clock  = read_ticks;
+    clock_glob.shift_clock = 0;
+    clock_glob.mult_clock  = NSEC_PER_TICK;
+    clock_glob.khz_clock   = 0;
+  }
+
+  clock_glob.base_clock = clock_glob.read_clock();
+
+  printk_system("Initialized clock..");
+  return true;
+}
+
+/*
+ * EF: clock_exit_func - clock exit function
+ *
+ * ARGS :-
+ *
+ * RET -
+ */
+void
+clock_exit_func(void)
+{
+}
@@ -0,0 +1,79 @@
+/* KalioOS (C) 2020 Pranav Bagur */
+
+/*
+ * A clocksource is a free running counter and the scale to turn its count
+ * into nanoseconds without a division:
+ *
+ *   ns = ((count - base) * mult) >> shift
+ *
+ * The TSC is used when the CPU has one. Its rate is measured at boot by
+ * timing a CLOCK_CAL_COUNT count down of PIT channel 2, which needs no
+ * interrupts. Without a TSC the clock falls back to ticks, so it only moves
+ * every 1000 / FREQUENCY ms.
+ *
+ * The timer wheel still counts in ticks, ns_to_ticks converts a delay.
+ */
+#ifndef __CLOCK_H
+#define __CLOCK_H
+
+#include "../../common/if/types.h"
+#include "timer.h"
+
+/* --------------------------------------------------------------------------
+                         Constants and types
+   -------------------------------------------------------------------------- */
+#define NSEC_PER_SEC     1000000000
+#define NSEC_PER_TICK    (NSEC_PER_SEC / FREQUENCY)
+
+#define PIT_CH2_DATA     0x42
+#define PIT_CH2_CMD      0xB0 /* channel 2, lo/hi byte, mode 0 (one-shot)  */
+#define PIT_CH2_PORT     0x61 /* gate and speaker enable, OUT status       */
+#define PIT_CH2_GATE     0x01
+#define PIT_CH2_SPEAKER  0x02
+#define PIT_CH2_OUT      0x20
+
+#define CLOCK_CAL_COUNT  59659 /* PIT counts the TSC is timed over (50ms) */
+#define CLOCK_CAL_NS     ((ub8)CLOCK_CAL_COUNT * NSEC_PER_SEC / PIT_HZ)
+#define CLOCK_CAL_SPINS  1000000 /* give up on channel 2 after this many  */
+#define CLOCK_TSC_SHIFT  24
+
+/* Reads the counter of a clocksource */
+typedef ub8 (*clock_read_t)(void);
+
+/* STRUCT clocksource_t - Describes the counter we keep time with */
+typedef struct _clocksource
+{
+  ub1          *name_clock;
+  clock_read_t  read_clock;
+  ub4           mult_clock;    /* ns = (count * mult) >> shift          */
+  ub4           shift_clock;
+  ub4           khz_clock;     /* counter rate, 0 for ticks              */
+  ub8           base_clock;    /* count at boot, ktime_get_ns 0          */
+} clocksource_t;
+
+/* --------------------------------------------------------------------------
+                         Macros
+   -------------------------------------------------------------------------- */
+
+/* --------------------------------------------------------------------------
+                         Export function declarations
+   -------------------------------------------------------------------------- */
+/* nanoseconds since boot */
+ub8 ktime_get_ns(void);
+
+/* ticks a delay of ns takes, rounded up */
+ub8 ns_to_ticks(ub8 ns);
+
+/* nanoseconds in a number of ticks */
+ub8 ticks_to_ns(ub8 nticks);
+
+/* name and rate of the clocksource in use */
+ub1 *clock_name(ub4 *khz);
+
+/* clock init function   */
+bool clock_init_func(void);
+
+/* clock exit function   */
+void clock_exit_func(void);
+
+#endif
@@ -24,11 +24,15 @@
 
 extern const ub1 *keyboard_map[128];
 extern ring_buf *rb_keyboard;
+extern volatile ub4 lines_keyboard; /* '\n's in rb_keyboard, see shell_main */
 
 /* -------------------------------------------------------------------------- 
                          Macros
    -------------------------------------------------------------------------- */ 
 
+/* Work for the shell: a whole line, or a full ring no '\n' can get into */
+#define KEYBOARD_PENDING()  (lines_keyboard || !rb_get_avail(rb_keyboard))
+
 /* -------------------------------------------------------------------------- 
                          Export function declarations
    -------------------------------------------------------------------------- */
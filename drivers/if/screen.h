@@ -5,12 +5,13 @@
 
 #include "../../common/if/types.h"
 #include "port.h"
+#include "../../mm/if/memory.h"
 
 /* -------------------------------------------------------------------------- 
                          Constants and types
    -------------------------------------------------------------------------- */ 
 
-#define VIDEO_MEMORY    0xb8000
+#define VIDEO_MEMORY    PHYS_TO_VIRT(0xb8000)  /* through the direct map */
 #define MAX_ROWS        25
 #define MAX_COLS        80
 #define WHITE_ON_BLACK  0x0f
@@ -44,6 +45,9 @@
 #define printk_shell_num(_num)                                                 \
   printk_num_attr(_num, GREEN_ON_BLACK); 
 
+#define printk_shell_hex(_num)                                                 \
+  printk_hex_attr(_num, GREEN_ON_BLACK); 
+
 
 /* -------------------------------------------------------------------------- 
                          Export function declarations
@@ -58,6 +62,12 @@ void printk_char_attr(const ub1 char_to_print, ub4 attr);
 /* print string at cursor position   */
 void printk_attr(const ub1 *msg, ub4 attr);
 
+/* print num in decimal at cursor position */
+void printk_num_attr(ub4 num, ub4 attr);
+
+/* print num in hex (0x...) at cursor position */
+void printk_hex_attr(ub4 num, ub4 attr);
+
 /* erase cursor */
 void erase_cursor(void);
 
@@ -17,6 +17,38 @@
  * OK, so we want to set the PIT up so it interrupts us at regular intervals, at
  * frequency f. To do this, we send the PIT a 'divisor'. This is the number that
  * it should divide it's input frequency (1.9131MHz) by
+ *
+ * Normally the PIT runs as a rate generator and IRQ0 is our tick. When the
+ * CPU goes idle and no timer is due for a few ticks, timer_idle puts it in
+ * one-shot mode instead, so the interrupt comes at the tick the next timer
+ * needs and the ones in between are skipped. The counter is 16 bits, so
+ * at FREQUENCY Hz a one-shot can only cover a couple of ticks. If some
+ * other interrupt wakes the CPU first, timer_idle_exit reads the counter,
+ * catches ticks up and cuts the one-shot short to the next tick boundary.
+ *
+ * Dynamic timers live on a hierarchical timing wheel (Varghese and Lauck,
+ * "Hashed and Hierarchical Timing Wheels"). The root wheel has a slot for
+ * each of the next TIMER_ROOT_SIZE ticks. Each wheel above it has
+ * TIMER_LVL_SIZE slots, each one covering a whole turn of the wheel below:
+ *
+ *   root     256 slots x 1 tick        ticks [0, 2^8)
+ *   level 0   64 slots x 2^8 ticks           [2^8, 2^14)
+ *   level 1   64 slots x 2^14 ticks          [2^14, 2^20)
+ *   level 2   64 slots x 2^20 ticks          [2^20, 2^26)
+ *   level 3   64 slots x 2^26 ticks          [2^26, 2^32)
+ *
+ * A timer is hashed into the slot of the lowest wheel whose range holds its
+ * delay. Every tick runs the root slot for that tick. Each time the root
+ * wheel wraps, the next slot of level 0 is cascaded: its timers are hashed
+ * again, now into the root wheel. Level 0 wrapping cascades level 1, and so
+ * on. Adding or removing a timer is a list operation, and a tick costs a slot
+ * plus (amortized) a fraction of a cascade, however many timers are pending.
+ *
+ * A timer is either owned by the module (add_dyn_timer, add_periodic_timer:
+ * taken from the timer cache and given back once it fires or is deleted) or
+ * embedded in a caller's own object (setup_dyn_timer). Only the latter may
+ * be touched after it fired. The wheel is shared with timer_exec, so
+ * everything that changes it from thread context runs under lock_intr.
  */
 
 #ifndef __TIMER_H
@@ -30,31 +62,58 @@
 /* -------------------------------------------------------------------------- 
                          Constants and types
    -------------------------------------------------------------------------- */ 
-#define N_TIMER_LISTS 5
+#define TIMER_ROOT_BITS 8
+#define TIMER_LVL_BITS  6
+#define TIMER_LEVELS    4       /* wheels above the root                 */
+#define TIMER_ROOT_SIZE (1 << TIMER_ROOT_BITS)
+#define TIMER_LVL_SIZE  (1 << TIMER_LVL_BITS)
+#define TIMER_ROOT_MASK (TIMER_ROOT_SIZE - 1)
+#define TIMER_LVL_MASK  (TIMER_LVL_SIZE - 1)
+#define TIMER_MAX_DELAY 0xFFFFFFFF /* longer delays are cut to this      */
+
+/* timer_t flags */
+#define TIMER_OWNED     0x1     /* from timer_cache, freed by the module */
 
 typedef void (*timer_func)(ub8);
 
 /* STRUCT timer_t - Describes a single delay/timer request */
 typedef struct _timer {
   list       link_timer;
-  ub8        delay_timer;
+  list      *head_timer;         /* wheel slot (or del list) we are on, */
+                                 /* NULL if idle                        */
+  ub8        expires_timer;      /* tick to fire at                     */
+  ub4        period_timer;       /* rearmed this many ticks later, or 0 */
+  ub4        flags_timer;
   timer_func func_timer;
   ub8        data_timer;
 } timer_t;
 
-/* STRUCT timer_list_t - Describes global timer object */
-typedef struct _list_timer {
-  list lists_timer[N_TIMER_LISTS];
-  ub4  lists_count_timer[N_TIMER_LISTS];
+/* STRUCT timer_wheel_t - Describes global timer object */
+typedef struct _timer_wheel {
+  list root_wheel[TIMER_ROOT_SIZE];
+  list lvl_wheel[TIMER_LEVELS][TIMER_LVL_SIZE];
+  ub8  clk_wheel;                /* next tick to run                    */
+  ub4  pending_wheel;            /* # timers on the wheels              */
+
+  list del_list_wheel;           /* fired, to be freed                  */
+  ub4  del_list_count_wheel;
+} timer_wheel_t;
 
-  list del_list_timer;
-  ub4  del_list_count_timer;
-} timer_list_t;
+extern timer_wheel_t *timer_glob;
+extern ub8            ticks;
 
 #define FREQUENCY 50 /* Hz */
 #define PIT_CMD   0x43
 #define PIT_DATA  0x40
 
+#define PIT_HZ        1193180
+#define PIT_DIVISOR   (PIT_HZ / FREQUENCY)
+#define PIT_MAX_COUNT 0xFFFF
+#define PIT_PERIODIC  0x34 /* channel 0, lo/hi byte, mode 2 (rate)     */
+#define PIT_ONESHOT   0x30 /* channel 0, lo/hi byte, mode 0 (one-shot) */
+#define PIT_LATCH     0x00 /* channel 0, latch the count for reading   */
+#define PIT_SLACK     64   /* counts (~50us) too close to reprogram    */
+
 /* -------------------------------------------------------------------------- 
                          Macros
    -------------------------------------------------------------------------- */ 
@@ -74,4 +133,25 @@ void timer_exit_func(void);
 /* Add a dynamic timer */
 timer_t *add_dyn_timer(ub8 delay, timer_func func, ub8 data);
 
+/* Add a dynamic timer that fires every period ticks until deleted */
+timer_t *add_periodic_timer(ub4 period, timer_func func, ub8 data);
+
+/* Initialize a caller owned timer, armed with mod_dyn_timer */
+void setup_dyn_timer(timer_t *timer, timer_func func, ub8 data, ub4 period);
+
+/* (Re)arm a timer to fire in delay ticks */
+bool mod_dyn_timer(timer_t *timer, ub8 delay);
+
+/* Cancel a pending timer */
+bool del_dyn_timer(timer_t *timer);
+
+/* number of timers waiting to fire */
+ub4 get_pending_timers(void);
+
+/* skip the ticks no timer needs, interrupts off, CPU about to halt */
+void timer_idle(void);
+
+/* catch up after the CPU halted, one-shot to the next tick */
+void timer_idle_exit(void);
+
 #endif
@@ -6,6 +6,7 @@
 #include "../common/if/ring_buffer.h"
 
 ring_buf *rb_keyboard;
+volatile ub4 lines_keyboard;
 const ub1 *keyboard_map[128] =
 {
    0,  0, "1", "2", "3", "4", "5", "6", "7", "8",
@@ -91,7 +92,10 @@ keyboard_exec(registers_t regs)
 
         if (str) {
           printk(str);
-          rb_push(rb_keyboard, (void *)str);
+
+          /* A whole line is in, the main loop runs the shell next */
+          if (rb_push(rb_keyboard, (void *)str) && str[0] == '\n')
+            lines_keyboard++;
         }
         break;
       }
@@ -114,6 +118,7 @@ keyboard_init_func()
   rb_keyboard = rb_init(sizeof(ub1), KEYBOARD_RING_BUF_MAX);
   if (!rb_keyboard)
     return false;
+  lines_keyboard = 0;
 
   printk_system("Initialized keyboard..");
   return true;
@@ -287,6 +287,30 @@ printk_num_attr(ub4 num, ub4 attr)
   printk_attr(str, attr);
 }
 
+/* 
+ * EF: printk_hex_attr - print num in hex at cursor position 
+ * 
+ * ARGS :-
+ *   num -  number to print
+ *   attr - color attributes
+ *
+ * RET -
+ */
+void 
+printk_hex_attr(ub4 num, ub4 attr)
+{
+  ub1 str[11];
+  ub4 idx;
+
+  str[0] = '0';
+  str[1] = 'x';
+  for (idx = 0; idx < 8; idx++)
+    str[2 + idx] = "0123456789abcdef"[(num >> (28 - idx * 4)) & 0xF];
+  str[10] = '\0';
+
+  printk_attr(str, attr);
+}
+
 /* 
  * EF: erase_cursor - Erase the cursor
  * 
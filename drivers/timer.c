@@ -4,30 +4,105 @@
 #include "../kernel/if/isr.h"
 #include "if/screen.h"
 #include "../mm/if/heap.h"
+#include "../mm/if/slab.h"
+#include "../mm/if/frame.h"
+#include "../common/if/lock_intr.h"
+
+ub8            ticks = 0;
+ub4            oneshot_ticks;  /* ticks the armed one-shot covers, or 0 */
+ub4            oneshot_count;  /* PIT counts it was armed with          */
+timer_wheel_t *timer_glob;
+kmem_cache_t  *timer_cache;
+shrinker_t     timer_shrinker;
+
+/* === SIF: Program PIT channel 0 === */
+static inline void
+pit_program(ub1 cmd, ub4 count)
+{
+  port_byte_out(PIT_CMD, cmd);
+
+  /* The count has to be sent byte-wise, lower byte first */
+  port_byte_out(PIT_DATA, (ub1)(count & 0xFF));
+  port_byte_out(PIT_DATA, (ub1)((count >> 8) & 0xFF));
+}
 
-ub8           ticks = 0;
-timer_list_t *timer_glob;
-ub4           list_delays[]  = {0, 50, 100, 500, 1000};
-ub4           list_process[] = {1, 3, 8, 15, 50};
+/* === SIF: Has the PIT raised IRQ0 and we did not take it yet === */
+static inline bool
+pit_irq_raised(void)
+{
+  port_byte_out(MASTER_PIC_CMD, PIC_READ_IRR);
+  return !!(port_byte_in(MASTER_PIC_CMD) & 0x1);
+}
+
+/* === SIF: Read the current count of PIT channel 0 === */
+static inline ub4
+pit_read(void)
+{
+  ub4 lower_byte;
+
+  port_byte_out(PIT_CMD, PIT_LATCH);
+  lower_byte = port_byte_in(PIT_DATA);
+  return lower_byte | ((ub4)port_byte_in(PIT_DATA) << 8);
+}
+
+/* === SIF: Is the timer on a wheel === */
+static inline bool
+timer_pending(timer_t *timer)
+{
+  return timer->head_timer &&
+         timer->head_timer != &timer_glob->del_list_wheel;
+}
+
+/* === SIF: Queue an owned timer to be freed, caller holds lock_intr === */
+static inline void
+timer_retire(timer_t *timer)
+{
+  list_add_tail(&timer_glob->del_list_wheel, &timer->link_timer);
+  timer->head_timer = &timer_glob->del_list_wheel;
+  timer_glob->del_list_count_wheel++;
+}
 
 /* 
- * SF: add_dyn_timer_to_list - Add dynamic timer to the appropriate list
+ * SF: wheel_add_timer - Hash a timer into its wheel slot
  * 
  * ARGS :-
- *   timer - address of dyn timer
+ *   timer - address of dyn timer, expires_timer set
  *
  * RET -
  */
 static void
-add_dyn_timer_to_list(timer_t *timer)
+wheel_add_timer(timer_t *timer)
 {
-  ub4 i     = (N_TIMER_LISTS - 1);
-  ub4 delay = timer->delay_timer;
+  ub8   expires = timer->expires_timer;
+  ub8   clk     = timer_glob->clk_wheel;
+  ub8   delta;
+  ub4   lvl     = 0;
+  list *head;
+
+  /* Overdue timers go in the slot that runs next */
+  if (expires < clk)
+    expires = clk;
+
+  delta = expires - clk;
+  if (delta < TIMER_ROOT_SIZE)
+    head = &timer_glob->root_wheel[(ub4)expires & TIMER_ROOT_MASK];
+  else {
+    if (delta > TIMER_MAX_DELAY) {
+      expires              = clk + TIMER_MAX_DELAY;
+      delta                = TIMER_MAX_DELAY;
+      timer->expires_timer = expires;
+    }
 
-  while (delay < (list_delays[i] + ticks)) i--;
+    while (lvl < TIMER_LEVELS - 1 &&
+           (delta >> (TIMER_ROOT_BITS + (lvl + 1) * TIMER_LVL_BITS)))
+      lvl++;
 
-  list_add_tail(&timer_glob->lists_timer[i], &timer->link_timer);
-  timer_glob->lists_count_timer[i]++;
+    head = &timer_glob->lvl_wheel[lvl][(ub4)(expires >>
+            (TIMER_ROOT_BITS + lvl * TIMER_LVL_BITS)) & TIMER_LVL_MASK];
+  }
+
+  list_add_tail(head, &timer->link_timer);
+  timer->head_timer = head;
 }
 
 /* 
@@ -40,86 +115,143 @@ add_dyn_timer_to_list(timer_t *timer)
 static void
 free_dyn_deleted_timers()
 {
-  while (timer_glob->del_list_count_timer) {
-    list    *item;
-    timer_t *timer;
+  list *item;
+  ub8   flags;
+
+  while (true) {
+    /* timer_exec adds to the list behind our back */
+    lock_intr(&flags);
+    item = list_remove_front(&timer_glob->del_list_wheel);
+    if (item)
+      timer_glob->del_list_count_wheel--;
+    unlock_intr(&flags);
 
-    item  = list_remove_front(&timer_glob->del_list_timer);
-    timer_glob->del_list_count_timer--;
+    if (!item)
+      break;
 
-    timer = list_entry(item, timer_t, link_timer);
-    kfree_heap((ub4 *)timer);
+    kmem_cache_free(timer_cache, list_entry(item, timer_t, link_timer));
   }
 }
 
 /* 
- * SF: process_dyn_list - process all the dynamic timers on a list
+ * SF: cascade_timers - Hash the timers of a slot down a wheel
  * 
  * ARGS :-
- *   cur_list - address of list
- *   idx      - index of list
+ *   lvl - wheel level
+ *   idx - slot of the wheel
+ *
+ * Everything in the slot is due within one turn of the wheel below
  *
  * RET -
+ *   idx, the caller cascades the next level up when it is 0
  */
-static void
-process_dyn_list(list *cur_list, ub4 idx)
+static ub4
+cascade_timers(ub4 lvl, ub4 idx)
 {
-  list tmp_list;
-  ub4  tmp_list_count = 0;
+  list *item;
 
-  list_init(&tmp_list);
-  /* 
-   * Move everything to a local list
-   * TODO implement list_for_each_safe and clean this up
-   */
-  while (timer_glob->lists_count_timer[idx]) {
-    list    *item;
-    timer_t *timer;
+  while ((item = list_remove_front(&timer_glob->lvl_wheel[lvl][idx])))
+    wheel_add_timer(list_entry(item, timer_t, link_timer));
 
-    item  = list_remove_front(&timer_glob->lists_timer[idx]);
-    timer_glob->lists_count_timer[idx]--;
+  return idx;
+}
 
-    timer = list_entry(item, timer_t, link_timer);
-    list_add_tail(&tmp_list, &timer->link_timer);
-    tmp_list_count++;
-  }
+/* 
+ * SF: process_dyn_timers - run the wheel up to the current tick
+ * 
+ * ARGS :-
+ *
+ * RET -
+ */
+static void
+process_dyn_timers()
+{
+  ub4      idx;
+  ub4      lvl;
+  list    *head;
+  list    *item;
+  timer_t *timer;
 
-  while (tmp_list_count) {
-    list    *item;
-    timer_t *timer;
+  while (timer_glob->clk_wheel <= ticks) {
+    idx = (ub4)timer_glob->clk_wheel & TIMER_ROOT_MASK;
 
-    item  = list_remove_front(&tmp_list);
-    tmp_list_count--;
+    /* The root wheel wrapped, pull in the next turn from above */
+    for (lvl = 0; !idx && lvl < TIMER_LEVELS; lvl++) {
+      if (cascade_timers(lvl, (ub4)(timer_glob->clk_wheel >>
+                         (TIMER_ROOT_BITS + lvl * TIMER_LVL_BITS)) &
+                         TIMER_LVL_MASK))
+        break;
+    }
+
+    /*
+     * The timer is rearmed, retired or idle before its callback runs, so
+     * the callback is free to mod or del it
+     */
+    head = &timer_glob->root_wheel[idx];
+    while ((item = list_remove_front(head))) {
+      timer = list_entry(item, timer_t, link_timer);
+
+      if (timer->period_timer) {
+        timer->expires_timer += timer->period_timer;
+        wheel_add_timer(timer);
+      }
+      else {
+        timer_glob->pending_wheel--;
+        if (timer->flags_timer & TIMER_OWNED)
+          timer_retire(timer);
+        else
+          timer->head_timer = NULL;
+      }
 
-    timer = list_entry(item, timer_t, link_timer);
-    if (idx == 0 && ((ub4)timer->delay_timer <= ticks)) {
       timer->func_timer((ub8)timer->data_timer);
-      list_add_tail(&timer_glob->del_list_timer, &timer->link_timer);
-      timer_glob->del_list_count_timer++;
-    }
-    else {
-      add_dyn_timer_to_list(timer);
     }
+
+    timer_glob->clk_wheel++;
   }
 }
 
 /* 
- * SF: process_dyn_timers - process all the dynamic timers
+ * SF: wheel_idle_ticks - How far off the next tick that matters is
  * 
  * ARGS :-
+ *   max - don't look further than this many ticks
+ *
+ * A tick matters if it has timers to run or has to cascade (the root wheel
+ * wraps). Called in thread context, where the wheel has caught up with ticks
  *
  * RET -
+ *   n, the ticks up to ticks + n are empty but the last
  */
-static void
-process_dyn_timers()
+static ub4
+wheel_idle_ticks(ub4 max)
 {
-  ub4 i;
-
-  for (i = 0; i < N_TIMER_LISTS; i++) {
-    if (((ub4)ticks % list_process[i]) == 0) { // ub8 __udivdi3 gcc err 
-      process_dyn_list(&timer_glob->lists_timer[i], i);
-    }
+  ub4 n = 1;
+  ub4 idx;
+
+  while (n < max) {
+    idx = (ub4)(ticks + n) & TIMER_ROOT_MASK;
+    if (!idx || !is_list_empty(&timer_glob->root_wheel[idx]))
+      break;
+    n++;
   }
+
+  return n;
+}
+
+/* 
+ * SF: timer_shrink - timer shrinker
+ * 
+ * ARGS :-
+ *
+ * Fired timers wait on del_list for the next add_dyn_timer, hand them
+ * back to the timer cache now
+ *
+ * RET -
+ */
+static void
+timer_shrink(void)
+{
+  free_dyn_deleted_timers();
 }
 
 /* 
@@ -135,17 +267,32 @@ init_dyn_timer()
 {
   ub4 i = 0;
 
-  timer_glob = (timer_list_t *)kmalloc_heap(sizeof(*timer_glob));
+  timer_glob = (timer_wheel_t *)kmalloc_heap_flags(sizeof(*timer_glob),
+                                                   HEAP_NOZERO);
   if (!timer_glob)
     return false;
 
-  for (i = 0; i < N_TIMER_LISTS; i++) {
-    list_init(&timer_glob->lists_timer[i]);
-    timer_glob->lists_count_timer[i] = 0;
-  }
-  
-  list_init(&timer_glob->del_list_timer);
-  timer_glob->del_list_count_timer = 0;
+  timer_cache = kmem_cache_create("timer", sizeof(timer_t), 0, NULL);
+  if (!timer_cache)
+    return false;
+
+  for (i = 0; i < TIMER_ROOT_SIZE; i++)
+    list_init(&timer_glob->root_wheel[i]);
+
+  for (i = 0; i < TIMER_LEVELS * TIMER_LVL_SIZE; i++)
+    list_init(&timer_glob->lvl_wheel[i / TIMER_LVL_SIZE]
+                                    [i % TIMER_LVL_SIZE]);
+
+  timer_glob->clk_wheel     = ticks;
+  timer_glob->pending_wheel = 0;
+
+  list_init(&timer_glob->del_list_wheel);
+  timer_glob->del_list_count_wheel = 0;
+
+  timer_shrinker.name_shrinker = "timer";
+  timer_shrinker.func_shrinker = timer_shrink;
+  timer_shrinker.prio_shrinker = SHRINK_PRIO_USER;
+  register_shrinker(&timer_shrinker);
   return true;
 }
 
@@ -159,45 +306,202 @@ init_dyn_timer()
 static void
 teardown_dyn_timer()
 {
+  unregister_shrinker(&timer_shrinker);
   free_dyn_deleted_timers();
+  kmem_cache_destroy(timer_cache);
   kfree_heap((ub4 *)timer_glob);
 }
 
+/* 
+ * SF: new_dyn_timer - Allocate and arm a module owned timer
+ * 
+ * ARGS :-
+ *   delay  - ticks to the first expiry
+ *   period - ticks between later ones, 0 for a one shot timer
+ *   func   - function pointer to invoke
+ *   data   - arg for the function pointer
+ *
+ * RET -
+ *   Address of the armed timer, NULL if out of memory
+ */
+static timer_t *
+new_dyn_timer(ub8 delay, ub4 period, timer_func func, ub8 data)
+{
+  timer_t *timer;
+
+  /* 
+   * We can't free from the interrupt handler, so fired timers are
+   * handed back here, where we are about to allocate anyway
+   */
+  free_dyn_deleted_timers();
+
+  timer = (timer_t *)kmem_cache_alloc(timer_cache);
+  if (!timer)
+    return NULL;
+
+  setup_dyn_timer(timer, func, data, period);
+  timer->flags_timer = TIMER_OWNED;
+  mod_dyn_timer(timer, delay);
+  return timer;
+}
+
 /* 
  * EF: add_dyn_timer - Register a dynamic timer with the module
  * 
  * ARGS :-
- *   delay - dealy in ms
- *   func  - function pointer to invoke in delay ms
+ *   delay - delay in ticks
+ *   func  - function pointer to invoke in delay ticks
  *   data  - arg for the function pointer
  *
+ * The timer is freed once it fired, so the address returned is only good
+ * for del_dyn_timer while the timer is pending
+ *
  * RET -
  *   Address of initialized timer object 
  */
 timer_t *
 add_dyn_timer(ub8 delay, timer_func func, ub8 data)
 {
-  timer_t *timer;
-
   if (delay == 0)
-    return false;
+    return NULL;
 
-  timer = (timer_t *)kmalloc_heap(sizeof(*timer));
-  if (!timer)
+  return new_dyn_timer(delay, 0, func, data);
+}
+
+/* 
+ * EF: add_periodic_timer - Register a dynamic timer that keeps firing
+ * 
+ * ARGS :-
+ *   period - ticks between expiries
+ *   func   - function pointer to invoke every period ticks
+ *   data   - arg for the function pointer
+ *
+ * Stays armed (and allocated) until del_dyn_timer
+ *
+ * RET -
+ *   Address of initialized timer object 
+ */
+timer_t *
+add_periodic_timer(ub4 period, timer_func func, ub8 data)
+{
+  if (period == 0)
     return NULL;
 
-  timer->delay_timer = delay + ticks;
-  timer->func_timer  = func;
-  timer->data_timer  = data;
+  return new_dyn_timer(period, period, func, data);
+}
 
-  add_dyn_timer_to_list(timer);
-  
-  /* 
-   * We don't have a locking mechanism yet. So, we'll call
-   * kheap_free from this context to avoid doing it in the
-   * interrupt handler
-   */
-  free_dyn_deleted_timers();
+/* 
+ * EF: setup_dyn_timer - Initialize a timer embedded in the caller's object
+ * 
+ * ARGS :-
+ *   timer  - address of the timer
+ *   func   - function pointer to invoke on expiry
+ *   data   - arg for the function pointer
+ *   period - ticks between expiries once armed, 0 for a one shot timer
+ *
+ * The timer stays idle until mod_dyn_timer. It must not be pending when
+ * the caller frees it
+ *
+ * RET -
+ */
+void
+setup_dyn_timer(timer_t *timer, timer_func func, ub8 data, ub4 period)
+{
+  timer->head_timer    = NULL;
+  timer->expires_timer = 0;
+  timer->period_timer  = period;
+  timer->flags_timer   = 0;
+  timer->func_timer    = func;
+  timer->data_timer    = data;
+}
+
+/* 
+ * EF: mod_dyn_timer - (Re)arm a timer
+ * 
+ * ARGS :-
+ *   timer - address of the timer
+ *   delay - ticks from now, at least 1
+ *
+ * Moves a pending timer, arms an idle one. An owned timer that has already
+ * fired is gone and is left alone
+ *
+ * RET -
+ *   true if the timer was pending
+ */
+bool
+mod_dyn_timer(timer_t *timer, ub8 delay)
+{
+  ub8  flags;
+  bool pending;
+
+  if (delay == 0)
+    delay = 1;
+
+  lock_intr(&flags);
+  pending = timer_pending(timer);
+  if (pending) {
+    list_remove(timer->head_timer, &timer->link_timer);
+    timer_glob->pending_wheel--;
+  }
+
+  if (timer->head_timer != &timer_glob->del_list_wheel) {
+    timer->expires_timer = ticks + delay;
+    wheel_add_timer(timer);
+    timer_glob->pending_wheel++;
+  }
+  unlock_intr(&flags);
+
+  return pending;
+}
+
+/* 
+ * EF: del_dyn_timer - Cancel a timer
+ * 
+ * ARGS :-
+ *   timer - address of the timer
+ *
+ * O(1), the timer knows the slot it is on. Safe against timer_exec: once
+ * this returns the callback will not run again (it may be running right
+ * now only if we are called from the callback itself). An owned timer is
+ * freed, a caller owned one goes idle and can be armed again
+ *
+ * RET -
+ *   true if the timer was pending
+ */
+bool
+del_dyn_timer(timer_t *timer)
+{
+  ub8  flags;
+  bool pending;
+
+  lock_intr(&flags);
+  pending = timer_pending(timer);
+  if (pending) {
+    list_remove(timer->head_timer, &timer->link_timer);
+    timer_glob->pending_wheel--;
+
+    if (timer->flags_timer & TIMER_OWNED)
+      timer_retire(timer);
+    else
+      timer->head_timer = NULL;
+  }
+  unlock_intr(&flags);
+
+  return pending;
+}
+
+/* 
+ * EF: get_pending_timers - number of timers waiting to fire
+ * 
+ * ARGS :-
+ *
+ * RET -
+ *   # timers on the wheels
+ */
+ub4
+get_pending_timers(void)
+{
+  return timer_glob->pending_wheel;
 }
 
 /* 
@@ -211,10 +515,130 @@ add_dyn_timer(ub8 delay, timer_func func, ub8 data)
 void 
 timer_exec(registers_t regs)
 {
-  ticks++;
+  if (oneshot_ticks) {
+    /* We are on a tick boundary, go back to a tick per period */
+    pit_program(PIT_PERIODIC, PIT_DIVISOR);
+    ticks        += oneshot_ticks;
+    oneshot_ticks = 0;
+  }
+  else
+    ticks++;
+
   process_dyn_timers();
 }
 
+/* 
+ * EF: timer_idle - Skip the ticks no timer needs
+ * 
+ * ARGS :-
+ *
+ * Called with interrupts off, right before the CPU halts. If nothing is due
+ * for a few ticks, the PIT is switched to one-shot mode for the first tick
+ * that is. The one-shot ends exactly when the periodic tick it replaces
+ * would have, so ticks does not drift. timer_idle_exit has to follow the
+ * halt
+ *
+ * RET -
+ */
+void
+timer_idle(void)
+{
+  ub4 left;
+  ub4 n;
+
+  /* Still armed from the last time we went idle */
+  if (oneshot_ticks)
+    return;
+
+  /* A tick raised but not yet taken, we won't halt for long anyway */
+  if (pit_irq_raised())
+    return;
+
+  /* Counts left in the current period, the first tick we skip */
+  left = pit_read();
+  if (left == 0 || left > PIT_DIVISOR)
+    return;
+
+  n = wheel_idle_ticks(1 + (PIT_MAX_COUNT - PIT_SLACK - left) / PIT_DIVISOR);
+  if (n < 2)
+    return;
+
+  oneshot_count = left + (n - 1) * PIT_DIVISOR;
+  pit_program(PIT_ONESHOT, oneshot_count);
+  oneshot_ticks = n;
+}
+
+/* 
+ * EF: timer_idle_exit - Back to a tick per period after the CPU halted
+ * 
+ * ARGS :-
+ *
+ * If some other interrupt woke the CPU before the one-shot fired, ticks
+ * has to catch up with the periods that went by, or timers armed now would
+ * count from a stale tick. The one-shot is then cut short to the next tick
+ * boundary, and timer_exec goes back to periodic mode from there.
+ *
+ * It stays a one-shot on purpose. OUT is low until a one-shot fires and the
+ * mode 2 control word drives it high, so switching to periodic mode here
+ * would latch a spurious IRQ0 and timer_exec would count a tick too many
+ *
+ * RET -
+ */
+void
+timer_idle_exit(void)
+{
+  ub8 flags;
+  ub4 left;
+  ub4 ahead;
+  ub4 past;
+
+  lock_intr(&flags);
+  if (!oneshot_ticks)
+    goto done;
+
+  /* Fired, timer_exec does the rest once we unlock. Past zero the count
+   * wraps round to PIT_MAX_COUNT, which is above any one-shot we program */
+  if (pit_irq_raised())
+    goto done;
+
+  left = pit_read();
+  if (left > oneshot_count)
+    goto done;
+
+  /* About to fire, too late to reprogram. Wait for it, same as above */
+  if (left < PIT_SLACK) {
+    while (!pit_irq_raised());
+    goto done;
+  }
+
+  /* Tick boundaries lie every PIT_DIVISOR counts before the end */
+  ahead = left / PIT_DIVISOR;
+  if (ahead > oneshot_ticks - 1)
+    ahead = oneshot_ticks - 1;
+
+  past  = oneshot_ticks - 1 - ahead;
+  left -= ahead * PIT_DIVISOR;
+
+  /* Too close to the next boundary to reprogram in time, call it crossed */
+  if (left < PIT_SLACK && ahead) {
+    past++;
+    left += PIT_DIVISOR;
+  }
+
+  /* Cut the one-shot short to the next boundary, unless it ends there */
+  if (ahead) {
+    pit_program(PIT_ONESHOT, left);
+    oneshot_count = left;
+  }
+
+  oneshot_ticks  = 1;
+  ticks         += past;
+  process_dyn_timers();
+
+done:
+  unlock_intr(&flags);
+}
+
 /* 
  * EF: timer_init_func - timer init function
  * 
@@ -225,10 +649,6 @@ timer_exec(registers_t regs)
 bool
 timer_init_func()
 {
-  ub4 divisor;
-  ub1 upper_byte;
-  ub1 lower_byte;
-
   /* Initialize the global timer object */
   if (!init_dyn_timer())
     return false;
@@ -242,23 +662,11 @@ timer_init_func()
    */
   register_handler(IRQ0, timer_exec);
   
-  /* see timer.h */
-  divisor = 1193180 / FREQUENCY;
-
   /* 
-   * Send the command byte. 0x36 sets the PIT to repeating mode (so that 
-   * when the divisor counter reaches zero it's automatically refreshed)
-   * and tells it we want to set the divisor value
+   * Rate generator mode, the counter is reloaded with the divisor every
+   * time it reaches zero (see timer.h)
    */
-  port_byte_out(PIT_CMD, 0x36);
-
-  // Divisor has to be sent byte-wise, so split here into upper/lower bytes.
-  lower_byte = (ub1)(divisor & 0xFF);
-  upper_byte = (ub1)((divisor >> 8) & 0xFF);
-
-  // Send the frequency divisor.
-  port_byte_out(PIT_DATA, lower_byte);
-  port_byte_out(PIT_DATA, upper_byte);
+  pit_program(PIT_PERIODIC, PIT_DIVISOR);
   printk_system("Initialized timer..");
   return true;
 }
@@ -1,37 +1,151 @@
 /* KalioOS (C) 2020 Pranav Bagur */
 
 #include "if/fs.h"
+#include "../mm/if/frame.h"
 
 /* -------------------------------------------------------------------------- 
                          Constants and types
    -------------------------------------------------------------------------- */ 
-vfs_node_t *root_node;
-vfs_node_t *cur_node;
-ub4         cur_inode = 0;
+vfs_node_t   *root_node;
+vfs_node_t   *cur_node;
+ub4           cur_inode = 0;
+kmem_cache_t *vfs_node_cache;
+shrinker_t    fs_shrinker;
 
 /* -------------------------------------------------------------------------- 
                          Static inline functions
    -------------------------------------------------------------------------- */ 
-static bool
-fs_grow_file(vfs_node_t *node)
+/* === SIF: vfs_node_t constructor (runs once, when its slab is created) === */
+static void
+fs_node_ctor(void *obj)
 {
-  ub4  new_size = node->allocated_len_vfs_node * 2;
-  ub1 *buf      = NULL;
+  memset((ub1 *)obj, sizeof(vfs_node_t), 0);
+}
 
-  buf = (ub1 *)kmalloc_heap(new_size);
-  if (!buf)
-    return false;
+/* === SIF: Free a file buffer, wherever it came from === */
+static inline void
+fs_free_buf(ub1 *buf)
+{
+  if (IS_VMALLOC_ADDR(buf))
+    vfree(buf);
+  else
+    kfree_heap((ub4 *)buf);
+}
+
+/* -------------------------------------------------------------------------- 
+                         Static functions
+   -------------------------------------------------------------------------- */ 
+/* 
+ * SF: fs_resize_file - move a file to a buffer of another size
+ * 
+ * ARGS :-
+ *   node     - file node
+ *   new_size - size of the new buffer (at least the file length)
+ *
+ * RET -
+ *   true iff successful
+ */
+static bool
+fs_resize_file(vfs_node_t *node, ub4 new_size)
+{
+  ub1 *buf = NULL;
+
+  if (new_size >= FS_VMALLOC_MIN) {
+    buf = (ub1 *)vmalloc(new_size);
+    if (!buf)
+      return false;
+  } else {
+    /* Only the part past the old contents needs zeroing */
+    buf = (ub1 *)kmalloc_heap_flags(new_size, HEAP_NOZERO);
+    if (!buf)
+      return false;
+
+    memset((ub1 *)(buf + node->file_len_vfs_node),
+           new_size - node->file_len_vfs_node, 0);
+  }
 
-  memset((ub1 *)buf, new_size, 0);
   memcpy(node->file_buf_vfs_node, buf, node->file_len_vfs_node);
 
-  kfree_heap((ub4 *)node->file_buf_vfs_node);
+  fs_free_buf(node->file_buf_vfs_node);
   node->file_buf_vfs_node = buf;
   node->allocated_len_vfs_node = new_size;
 
   return true;
 }
 
+/* 
+ * SF: fs_grow_file - make room for min_size bytes in a file
+ * 
+ * ARGS :-
+ *   node     - file node
+ *   min_size - bytes needed
+ *
+ * RET -
+ *   true iff successful
+ */
+static bool
+fs_grow_file(vfs_node_t *node, ub4 min_size)
+{
+  ub4 new_size = node->allocated_len_vfs_node * 2;
+
+  while (new_size < min_size)
+    new_size *= 2;
+
+  return fs_resize_file(node, new_size);
+}
+
+/* 
+ * SF: fs_trim_node - trim the buffers of closed files under a node
+ * 
+ * ARGS :-
+ *   node - node to start from
+ *
+ * Empty files drop their buffer (open_fs gets a new one), the others move
+ * to the smallest power of 2 buffer that holds them. Files are not paged
+ * out anywhere, their contents always stay
+ *
+ * RET -
+ */
+static void
+fs_trim_node(vfs_node_t *node)
+{
+  list *cur;
+  ub4   new_size = DEFAULT_BUF_SIZE;
+
+  list_for_each(cur, &node->nodes_list_vfs_node)
+    fs_trim_node(list_entry(cur, vfs_node_t, link_vfs_node));
+
+  if (node->opened_vfs_node || !node->allocated_len_vfs_node)
+    return;
+
+  if (!node->file_len_vfs_node) {
+    fs_free_buf(node->file_buf_vfs_node);
+    node->file_buf_vfs_node      = NULL;
+    node->allocated_len_vfs_node = 0;
+    return;
+  }
+
+  while (new_size < node->file_len_vfs_node)
+    new_size *= 2;
+
+  /* Under pressure the smaller buffer may not be there, keep the old one */
+  if (new_size < node->allocated_len_vfs_node)
+    fs_resize_file(node, new_size);
+}
+
+/* 
+ * SF: fs_shrink - fs shrinker
+ * 
+ * ARGS :-
+ *
+ * RET -
+ */
+static void
+fs_shrink(void)
+{
+  fs_trim_node(root_node);
+}
+
 /* -------------------------------------------------------------------------- 
                          Export functions
    -------------------------------------------------------------------------- */ 
@@ -52,15 +166,19 @@ vfs_node_t *
 fs_init_node(ub1 *name, ub4 flags, vfs_node_t *parent)
 {
   vfs_node_t *node;
+  ub4         len = strlen(name);
 
-  node = (vfs_node_t *)kmalloc_heap(sizeof(*node));
+  node = (vfs_node_t *)kmem_cache_alloc(vfs_node_cache);
   if (!node)
     goto err_exit;
 
-  memset((ub1 *)node, sizeof(*node), 0);
+  /* Every other field is set below, only the name needs clearing */
+  if (len >= sizeof(node->name_vfs_node))
+    len = sizeof(node->name_vfs_node) - 1;
+  memset((ub1 *)node->name_vfs_node, sizeof(node->name_vfs_node), 0);
 
   /* Initialize defaults for our initrd*/
-  memcpy(name, node->name_vfs_node, strlen(name));
+  memcpy(name, node->name_vfs_node, len);
   node->magic_vfs_node            = VFS_NODE_MAGIC;
   node->flags_vfs_node            = flags;
   node->inode_vfs_node            = cur_inode++;
@@ -99,7 +217,9 @@ err_exit:
 void
 fs_exit_node(vfs_node_t *node)
 {
-  kfree_heap((ub4 *)node);
+  /* Stale references to this node must fail the magic check */
+  node->magic_vfs_node = 0;
+  kmem_cache_free(vfs_node_cache, node);
 }
 
 /* 
@@ -172,13 +292,16 @@ ub4 read_fs(vfs_node_t *node, ub4 offset, ub4 size, ub1 *buffer)
 ub4 write_fs(vfs_node_t *node, ub4 offset, ub4 size, ub1 *buffer)
 {
   if (offset + size > node->allocated_len_vfs_node)
-    if (!fs_grow_file(node))
+    if (!fs_grow_file(node, offset + size))
       return 0;
 
   printk_shell("writing: ");
   printk_shell(buffer);
   printk_shell("\n");
   memcpy((ub1 *)buffer, (ub1 *)(node->file_buf_vfs_node + offset), size);
+  if (offset + size > node->file_len_vfs_node)
+    node->file_len_vfs_node = offset + size;
+
   printk_shell(node->file_buf_vfs_node);
   printk_shell("\n");
   return size;
@@ -191,10 +314,9 @@ vfs_node_t *open_fs(vfs_node_t *node)
   ASSERT((node->flags_vfs_node & VFS_DIRECTORY) == 0);
   if (node->allocated_len_vfs_node == 0) {
     node->file_buf_vfs_node = (ub1 *)kmalloc_heap(DEFAULT_BUF_SIZE);
-    if (!node)
+    if (!node->file_buf_vfs_node)
       return NULL;
 
-    memset((ub1 *)node->file_buf_vfs_node, DEFAULT_BUF_SIZE, 0);
     node->allocated_len_vfs_node = DEFAULT_BUF_SIZE;
   }
 
@@ -264,6 +386,11 @@ fs_init_func(void)
   vfs_node_t *node;
   ub4         i = 0;
   ub1        *node_names[5] = {"scratch", "var", "bin", "log", "home"};
+
+  vfs_node_cache = kmem_cache_create("vfs_node", sizeof(vfs_node_t), 0,
+                                     fs_node_ctor);
+  if (!vfs_node_cache)
+    return false;
   
   root_node = fs_init_node("/", VFS_DIRECTORY, NULL);
 
@@ -278,6 +405,11 @@ fs_init_func(void)
   list_add_tail(&node->nodes_list_vfs_node, &cur_node->link_vfs_node);
   cur_node->nodes_list_count_vfs_node++;
 
+  fs_shrinker.name_shrinker = "fs";
+  fs_shrinker.func_shrinker = fs_shrink;
+  fs_shrinker.prio_shrinker = SHRINK_PRIO_USER;
+  register_shrinker(&fs_shrinker);
+
   printk_system("Initialized FS..");
   return true;
 }
@@ -7,10 +7,15 @@
 #include "../../common/if/common.h"
 #include "../../common/if/list.h"
 #include "vfs.h"
+#include "../../mm/if/heap.h"
+#include "../../mm/if/slab.h"
+#include "../../mm/if/vma.h"
 
 /* -------------------------------------------------------------------------- 
                          Constants and types
    -------------------------------------------------------------------------- */ 
+/* File buffers this big come from vmalloc, they need not be contiguous */
+#define FS_VMALLOC_MIN  (4 * PAGE_SIZE)
 
 /* -------------------------------------------------------------------------- 
                          Export function declarations
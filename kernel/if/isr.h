@@ -122,6 +122,7 @@ idt_t idt_desc;
 #define MASTER_PIC_DATA 0x21
 #define SLAVE_PIC_CMD   0xA0
 #define SLAVE_PIC_DATA  0xA1
+#define PIC_READ_IRR    0x0A  /* OCW3, next CMD read returns raised IRQs */
 
 /* How an IRQ handler must look */
 typedef void (*isr_t)(registers_t); 
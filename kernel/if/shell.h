@@ -28,13 +28,13 @@
 #include "../../common/if/common.h"
 #include "../../common/if/list.h"
 #include "../../mm/if/heap.h"
+#include "../../mm/if/arena.h"
 
 /* -------------------------------------------------------------------------- 
                          Constants and types
    -------------------------------------------------------------------------- */ 
 /* 
  * STRUCT shell_args_t - Describes a command argument
- * the tub) 
  */
 typedef struct _sa
 {
@@ -52,6 +52,8 @@ typedef struct _sc
 
   ub1      *cmd_sc;
   ub4       cmd_len_sc;
+
+  arena_t  *arena_sc;    /* everything of this command lives here */
 } shell_cmd_t;
 
 /* Describes a command handler routine */
@@ -52,4 +52,10 @@ void shell_cmd_cat(shell_cmd_t *cmd);
 /* handler for command "ls" */
 void shell_cmd_ls(shell_cmd_t *cmd);
 
+/* handler for command "memprof" */
+void shell_cmd_memprof(shell_cmd_t *cmd);
+
+/* handler for command "meminfo" */
+void shell_cmd_meminfo(shell_cmd_t *cmd);
+
 #endif
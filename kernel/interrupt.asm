@@ -6,6 +6,10 @@
 
 ; Common ISR code
 isr_common:
+  ; The C code expects the direction flag clear, it may be set if we came in
+  ; during a backward copy. IRET brings the interrupted flags back
+	cld
+
   ; See isr.h (1 & 2 are already done by this point)
   ; 3. Save CPU state
 	pusha
@@ -43,6 +47,7 @@ isr_common:
 ; Common IRQ code. Identical to ISR code except for the 'call' 
 ; and the 'pop ebx'
 irq_common:
+    cld                 ; See isr_common
     pusha 
     mov ax, ds
     push eax
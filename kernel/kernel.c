@@ -1,27 +1,35 @@
 /* KalioOS (C) 2020 Pranav Bagur */
 
 #include "../common/if/common.h"
+#include "../common/if/cpu.h"
 #include "../drivers/if/screen.h"
 #include "if/isr.h"
 #include "if/shell.h"
 #include "../drivers/if/timer.h"
+#include "../drivers/if/clock.h"
 #include "../drivers/if/keyboard.h"
+#include "../mm/if/memory.h"
+#include "../mm/if/frame.h"
 #include "../mm/if/paging.h"
 #include "../mm/if/heap.h"
+#include "../mm/if/slab.h"
+#include "../mm/if/vma.h"
 #include "../fs/if/fs.h"
 #include "../test/if/tests.h"
 
-#define TIMER_LOOP_MAGIC 0x4123
-
-ub4 process = 1;
-
 /* Driver init function pointers */
 static bool (*_inits[])(void) = {
   screen_init_func,
+  cpu_init_func,
+  memory_init_func,
   isr_init_func,
   paging_init_func,
+  frame_init_func,
   heap_init_func,
+  slab_init_func,
+  vma_init_func,
   timer_init_func,
+  clock_init_func,
   keyboard_init_func,
   fs_init_func,
   shell_init_func
@@ -30,10 +38,16 @@ static bool (*_inits[])(void) = {
 /* Driver exit function pointers */
 static void (*_exits[])(void) = {
   screen_exit_func,
+  cpu_exit_func,
+  memory_exit_func,
   isr_exit_func,
   paging_exit_func,
+  frame_exit_func,
   heap_exit_func,
+  slab_exit_func,
+  vma_exit_func,
   timer_exit_func,
+  clock_exit_func,
   keyboard_exit_func,
   fs_exit_func,
   shell_exit_func
@@ -41,29 +55,41 @@ static void (*_exits[])(void) = {
 
 
 /*
- * EF: timer_callback - timer callback routine
+ * SF: kernel_idle - halt until the next interrupt
  *
  * ARGS :-
  *
+ * Interrupts are off between the check for a line and the hlt, and sti
+ * only takes effect after the next instruction, so a newline can't slip in
+ * between and leave us halted
+ *
  * RET -
  */
-void
-timer_cb(ub8 data)
+static void
+kernel_idle()
 {
-#ifdef DEBUG
-  printk("callback called with data: ");
-  printk_num((ub4)data);
-  printk("\n");
-#endif
-  ASSERT (data == TIMER_LOOP_MAGIC);
-  process = 1;
+  asm volatile("cli" ::: "memory");
+  if (KEYBOARD_PENDING()) {
+    asm volatile("sti");
+    return;
+  }
+
+  timer_idle();
+  asm volatile("sti; hlt" ::: "memory");
+  timer_idle_exit();
 }
 
-/* Kernel Entry */
-void main()
+/* 
+ * Kernel Entry - mem_map is the BIOS memory map (see detect_memory.asm).
+ * kernel_entry.asm has already moved us to the higher half
+ */
+void main(e820_map_t *mem_map)
 {
   int i;
 
+  /* Has to happen before paging and the frame allocator come up */
+  init_mem_map(mem_map);
+
   /* Enable interrupts */
   asm volatile("sti");
 
@@ -73,13 +99,17 @@ void main()
   /* Add a new line before control shell */
   printk_system(" ");
 
+  /*
+   * keyboard_exec wakes us up from kernel_idle once a line is in. A full
+   * ring is drained too, or the '\n' could never get in after it
+   */
   while (true) {
-    if (process) {
-      process = 0;
-      add_dyn_timer(30, &timer_cb, TIMER_LOOP_MAGIC);
+    if (KEYBOARD_PENDING()) {
       if (!shell_main())
         goto done;
     }
+    else if (!fill_zero_pool())
+      kernel_idle();
   }
 
 done:
@@ -6,7 +6,114 @@
 ; Place this at KERNEL_OFFSET and then we'll always jump to our main code
 ; The linker will place our call to main, with the correct address (depending
 ; on where main ends up in the linked file)
+;
+; The kernel is loaded at KERNEL_OFFSET but linked KERNEL_VIRT_BASE higher
+; (see the Makefile). Until paging is on, only code that uses no kernel
+; symbols can run, so the first thing we do is map the first BOOT_MAP_END
+; bytes of memory twice:
+;
+;   0x00000000 ... BOOT_MAP_END                     (identity, to get going)
+;   KERNEL_VIRT_BASE ... KERNEL_VIRT_BASE + BOOT_MAP_END  (where we link)
+;
+; then jump up, move the stack and the GDT up as well and call main. The
+; identity map goes away once paging_init_func switches to the real page
+; directory. The boot page directory and tables live in free low memory,
+; below FREE_MEM_START, which the frame allocator never hands out.
+;
+; Keep these in sync with mm/if/memory.h
 [bits 32]
 [extern main] ; Define calling point. Must have same name as kernel.c 'main' function
-call main ; Calls the C function. The linker will know where it is placed in memory
-jmp $
+
+KERNEL_VIRT_BASE equ 0xC0000000
+BOOT_MAP_END     equ 0x1000000             ; 16 MB
+BOOT_PAGE_DIR    equ 0x1000                ; physical
+BOOT_PAGE_TABLES equ 0x2000                ; physical, right after the dir
+BOOT_TABLES      equ BOOT_MAP_END / 0x400000
+KERNEL_PDE       equ KERNEL_VIRT_BASE >> 22
+
+    cld
+
+; Page tables: entry i maps frame i (present, writable)
+    mov edi, BOOT_PAGE_TABLES
+    mov eax, 0x3
+    mov ecx, BOOT_TABLES * 1024
+.fill_tables:
+    stosd
+    add eax, 0x1000
+    loop .fill_tables
+
+; Page directory: the same tables at 0 and at KERNEL_VIRT_BASE
+    mov edi, BOOT_PAGE_DIR
+    xor eax, eax
+    mov ecx, 1024
+    rep stosd
+
+    mov eax, BOOT_PAGE_TABLES | 0x3
+    xor ebx, ebx
+.fill_dir:
+    mov [BOOT_PAGE_DIR + ebx * 4], eax
+    mov [BOOT_PAGE_DIR + KERNEL_PDE * 4 + ebx * 4], eax
+    add eax, 0x1000
+    inc ebx
+    cmp ebx, BOOT_TABLES
+    jne .fill_dir
+
+    mov eax, BOOT_PAGE_DIR
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80000000 ; Enable paging!
+    mov cr0, eax
+
+; Absolute jump, we are linked in the higher half
+    mov eax, higher_half
+    jmp eax
+
+higher_half:
+; The bootloader's GDT is in low memory as well
+    lgdt [gdt_descriptor]
+    jmp CODE_SEG:.reload_segments
+.reload_segments:
+    mov ax, DATA_SEG
+    mov ds, ax
+    mov ss, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    mov eax, [esp + 4]        ; The memory map the bootloader pushed for us
+    add esp, KERNEL_VIRT_BASE ; Same stack, through the higher half
+    add ebp, KERNEL_VIRT_BASE
+    add eax, KERNEL_VIRT_BASE
+    push eax                  ; Forward the memory map to main
+    call main ; Calls the C function. The linker will know where it is placed in memory
+    jmp $
+
+; Same flat segments as boot/gdt.asm
+gdt_start:
+    dd 0x0
+    dd 0x0
+
+gdt_code:
+    dw 0xffff
+    dw 0x0
+    db 0x0
+    db 10011010b
+    db 11001111b
+    db 0x0
+
+gdt_data:
+    dw 0xffff
+    dw 0x0
+    db 0x0
+    db 10010010b
+    db 11001111b
+    db 0x0
+
+gdt_end:
+
+gdt_descriptor:
+    dw gdt_end - gdt_start - 1
+    dd gdt_start
+
+CODE_SEG equ gdt_code - gdt_start
+DATA_SEG equ gdt_data - gdt_start
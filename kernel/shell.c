@@ -19,10 +19,11 @@ static void shell_print_command(shell_cmd_t *cmd);
 /*
  * TODO Use a Trie? Might have to rewrite this entire file
  */
-ub1 local_shell_buf[KEYBOARD_RING_BUF_MAX];
-ub4 local_shell_buf_idx;
+ub1           local_shell_buf[KEYBOARD_RING_BUF_MAX];
+ub4           local_shell_buf_idx;
+arena_t       shell_arena;   /* reset after every command */
 
-shell_cmds_t cmds[13] = {
+shell_cmds_t cmds[15] = {
   {"clear",  shell_cmd_clear,  0, 0,              "clear screen"},
   {"whoami", shell_cmd_whoami, 0, 0,              "print current uid"},
   {"pwd",    shell_cmd_pwd,    0, 0,              "print working dir"},
@@ -35,7 +36,9 @@ shell_cmds_t cmds[13] = {
   {"echo",   shell_cmd_echo,   1, 1,              "echo back the arg"},
   {"write",  shell_cmd_write,  2, 2,              "write to file"},
   {"cat",    shell_cmd_cat,    1, 1,              "read file"},
-  {"ls",     shell_cmd_ls,     0, 0,              "list children of cur node"}
+  {"ls",     shell_cmd_ls,     0, 0,              "list children of cur node"},
+  {"memprof",shell_cmd_memprof,0, 0,              "top heap users by call site"},
+  {"meminfo",shell_cmd_meminfo,0, 0,              "memory statistics"}
 };
 
 /* --------------------------------------------------------------------------
@@ -82,11 +85,10 @@ shell_add_token(shell_cmd_t *cur_cmd, ub1 *cur_token, ub4 len)
     shell_args_t *arg;
 
     /* Found a new argument - add it to our list */
-    arg = (shell_args_t *)kmalloc_heap(sizeof(*arg));
+    arg = (shell_args_t *)arena_alloc(cur_cmd->arena_sc, sizeof(*arg));
     if (!arg)
       goto err_exit;
 
-    memset((ub1 *)arg, sizeof(*arg), 0);
     arg->arg_sa     = cur_token; /* refer to local_shell_buf */
     arg->arg_len_sa = len;
     list_add_tail(&cur_cmd->arg_list_sc, &arg->link_sa);
@@ -131,24 +133,14 @@ shell_print_command(shell_cmd_t *cmd) {
  * ARGS :-
  *   cmd - parsed cmd structure (see shell.h)
  *
+ * The cmd, its args and whatever the handler took from the arena go at once
+ *
  * RET
  */
 static void
 shell_free_tokens(shell_cmd_t *cur_cmd)
 {
-  list *item;
-
-  while(cur_cmd->args_count_sc) {
-    shell_args_t *arg;
-
-    item = list_remove_front(&cur_cmd->arg_list_sc);
-    cur_cmd->args_count_sc--;
-
-    arg = list_entry(item, shell_args_t, link_sa);
-    kfree_heap((ub4 *)arg);
-  }
-
-  kfree_heap((ub4 *)cur_cmd);
+  arena_reset(cur_cmd->arena_sc);
 }
 
 /*
@@ -169,16 +161,16 @@ shell_tokenize(ub1 *cmd_str)
   ub4          len     = 0;
   bool         esc_set = false;
 
-  cur_cmd = (shell_cmd_t *)kmalloc_heap(sizeof(*cur_cmd));
+  cur_cmd = (shell_cmd_t *)arena_alloc(&shell_arena, sizeof(*cur_cmd));
   if (!cur_cmd) {
     goto err_exit;
   }
 
-  memset((ub1 *)cur_cmd, sizeof(*cur_cmd), 0);
   list_init(&cur_cmd->arg_list_sc);
   cur_cmd->args_count_sc = 0;
   cur_cmd->cmd_len_sc    = 0;
   cur_cmd->cmd_sc        = NULL;
+  cur_cmd->arena_sc      = &shell_arena;
 
   /* get rid of leading whitespaces */
   while (cmd_str[i] == ' ') i++;
@@ -307,6 +299,7 @@ shell_main()
        */
       local_shell_buf[local_shell_buf_idx] = '\0';
       local_shell_buf_idx = 0;
+      lines_keyboard--;
       found_cmd = true;
       break;
     }
@@ -336,6 +329,8 @@ bool
 shell_init_func()
 {
   local_shell_buf_idx = 0;
+  arena_init(&shell_arena);
+
   printk_system("Initialized shell..");
   return true;
 }
@@ -350,4 +345,5 @@ shell_init_func()
 void
 shell_exit_func()
 {
+  arena_destroy(&shell_arena);
 }
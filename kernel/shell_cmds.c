@@ -5,6 +5,7 @@
 #include "../common/if/common.h"
 #include "../common/if/stack.h"
 #include "../fs/if/fs.h"
+#include "../mm/if/frame.h"
 
 vfs_node_t *prev_node = NULL;
 
@@ -35,6 +36,16 @@ shell_cmd_add_node(shell_cmd_t *cmd, vfs_node_t *cur_node, ub4 flag)
   }
 }
 
+/* === SIF: print "name value" for meminfo === */
+static inline void
+shell_print_stat(ub1 *name, ub4 value)
+{
+  printk_shell(name);
+  printk_shell(" ");
+  printk_shell_num(value);
+  printk_shell("  ");
+}
+
 /* --------------------------------------------------------------------------
                          Export functions
    -------------------------------------------------------------------------- */
@@ -368,14 +379,13 @@ shell_cmd_cat(shell_cmd_t *cmd)
     }
     else {
       if (open_fs(node)) {
-        ub1 *buf = (ub1 *)kmalloc_heap(DEFAULT_BUF_SIZE);
+        /* Goes away with the command */
+        ub1 *buf = (ub1 *)arena_alloc(cmd->arena_sc, DEFAULT_BUF_SIZE);
         if (buf) {
-          memset((ub1 *)buf, DEFAULT_BUF_SIZE, 0);
           read_fs(node, 0, DEFAULT_BUF_SIZE, buf);
           erase_cursor();
           printk_shell(buf);
           printk_shell("\n");
-          kfree_heap((ub4 *) buf);
         }
         close_fs(node);
       }
@@ -397,3 +407,102 @@ shell_cmd_ls(shell_cmd_t *cmd)
 
   (*node->ls_vfs_node)(node);
 }
+
+/*
+ * EF: shell_cmd_memprof - handler for command "memprof"
+ *
+ * ARGS :- parsed command structure
+ *
+ * RET
+ */
+void
+shell_cmd_memprof(shell_cmd_t *cmd)
+{
+  erase_cursor();
+  heap_prof_dump(HEAP_PROF_TOP);
+}
+
+/*
+ * EF: shell_cmd_meminfo - handler for command "meminfo"
+ *
+ * ARGS :- parsed command structure
+ *
+ * Everything printed is a counter kept up to date by the allocators, no
+ * list is walked. Chunks cached in magazines are free but not in use.
+ * Fragmentation is the share of chunks that are free but stuck in bundles
+ * that are partly in use
+ *
+ * RET
+ */
+void
+shell_cmd_meminfo(shell_cmd_t *cmd)
+{
+  tub_t *tub;
+  ub4    idx;
+  ub4    stuck;
+  ub4    stuck_bytes = 0;
+  ub4    total_bytes = 0;
+  ub4    frag        = 0;
+
+  erase_cursor();
+  shell_print_stat("frames", get_total_frames());
+  shell_print_stat("free", get_free_frames());
+  shell_print_stat("used", get_total_frames() - get_free_frames());
+  shell_print_stat("zero pool", get_zero_pool_frames());
+  shell_print_stat("page tables", get_page_table_frames());
+  shell_print_stat("shrinker runs", get_shrink_runs());
+  printk_shell("\nfree blocks by order:");
+  for (idx = 0; idx <= FRAME_MAX_ORDER; idx++) {
+    printk_shell(" ");
+    printk_shell_num(get_free_blocks(idx));
+  }
+
+  printk_shell("\n");
+  shell_print_stat("bundles", heap_glob->total_bundles);
+  shell_print_stat("max", heap_glob->max_bundles);
+  shell_print_stat("large allocs", heap_glob->large_allocs_heap);
+  shell_print_stat("large frames", heap_glob->large_frames_heap);
+  shell_print_stat("magazines", heap_glob->mags_heap);
+  shell_print_stat("vmalloc pages", vma_glob->pages_area);
+
+  printk_shell("\nsize  in use/total  cached  allocs  frees  grows  shrinks");
+  printk_shell("  frag%\n");
+  for (idx = 0; idx < N_TUBS; idx++) {
+    tub = &heap_glob->tubs[idx];
+    if (!tub->allocs_tub)
+      continue;
+
+    stuck = tub->avl_chunks_count_tub -
+            tub->empty_count_tub * tub->chunks_per_bundle_tub;
+    stuck_bytes += stuck * tub->size_tub;
+    total_bytes += tub->total_tub * tub->size_tub;
+
+    printk_shell_num(tub->size_tub);
+    printk_shell("  ");
+    printk_shell_num(tub->total_in_use_tub - tub->cached_tub);
+    printk_shell("/");
+    printk_shell_num(tub->total_tub);
+    printk_shell("  ");
+    printk_shell_num(tub->cached_tub);
+    printk_shell("  ");
+    printk_shell_num(tub->allocs_tub);
+    printk_shell("  ");
+    printk_shell_num(tub->frees_tub);
+    printk_shell("  ");
+    printk_shell_num(tub->grows_tub);
+    printk_shell("  ");
+    printk_shell_num(tub->shrinks_tub);
+    printk_shell("  ");
+    printk_shell_num(tub->total_tub ? (stuck * 100) / tub->total_tub : 0);
+    printk_shell("\n");
+  }
+
+  /* Scale total_bytes down, stuck_bytes * 100 could overflow */
+  if (total_bytes >= 100)
+    frag = stuck_bytes / (total_bytes / 100);
+  else if (total_bytes)
+    frag = (stuck_bytes * 100) / total_bytes;
+
+  shell_print_stat("heap frag%", frag);
+  printk_shell("\n");
+}
@@ -0,0 +1,139 @@
+/* KalioOS (C) 2020 Pranav Bagur */
+
+#include "if/arena.h"
+#include "if/frame.h"
+#include "../common/if/common.h"
+
+/* --------------------------------------------------------------------------
+                         Static functions
+   -------------------------------------------------------------------------- */
+/*
+ * SF: arena_next_block - move on to the next block of an arena
+ *
+ * ARGS :-
+ *   arena - arena whose current block is used up
+ *
+ * Blocks kept from before the last reset are used before new ones
+ *
+ * RET
+ *   true iff there is a block to allocate from
+ */
+static bool
+arena_next_block(arena_t *arena)
+{
+  list          *next;
+  arena_block_t *block;
+  ub4            addr;
+
+  if (arena->block_arena)
+    next = arena->block_arena->link_block.next;
+  else
+    next = arena->blocks_arena.next;
+
+  if (next)
+    block = list_entry(next, arena_block_t, link_block);
+  else {
+    addr = alloc_frame();
+    if (!addr)
+      return false;
+
+    block = (arena_block_t *)PHYS_TO_VIRT(addr);
+    list_add_tail(&arena->blocks_arena, &block->link_block);
+    arena->blocks_count_arena++;
+  }
+
+  arena->block_arena = block;
+  arena->cur_arena   = (ub1 *)(block + 1);
+  arena->end_arena   = (ub1 *)block + PAGE_SIZE;
+  return true;
+}
+
+/* --------------------------------------------------------------------------
+                         Export functions
+   -------------------------------------------------------------------------- */
+/*
+ * EF: arena_init - initialize an empty arena
+ *
+ * ARGS :-
+ *   arena - arena to initialize
+ *
+ * No memory is taken until the first arena_alloc
+ *
+ * RET
+ */
+void
+arena_init(arena_t *arena)
+{
+  list_init(&arena->blocks_arena);
+  arena->blocks_count_arena = 0;
+  arena_reset(arena);
+}
+
+/*
+ * EF: arena_alloc - allocate from an arena
+ *
+ * ARGS :-
+ *   arena - arena to allocate from
+ *   size  - required size, at most ARENA_MAX_ALLOC
+ *
+ * The memory is not zeroed. What does not fit in the current block goes in
+ * the next one, the rest of the current block is wasted
+ *
+ * RET
+ *   ARENA_ALIGN aligned address, NULL if out of memory or too big
+ */
+void *
+arena_alloc(arena_t *arena, ub4 size)
+{
+  ub1 *addr;
+
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  if (size > ARENA_MAX_ALLOC)
+    return NULL;
+
+  if ((!arena->block_arena || arena->cur_arena + size > arena->end_arena) &&
+      !arena_next_block(arena))
+    return NULL;
+
+  addr              = arena->cur_arena;
+  arena->cur_arena += size;
+  return addr;
+}
+
+/*
+ * EF: arena_reset - free everything allocated from an arena
+ *
+ * ARGS :-
+ *   arena - arena to reset
+ *
+ * O(1), the blocks stay with the arena for the next round
+ *
+ * RET
+ */
+void
+arena_reset(arena_t *arena)
+{
+  arena->block_arena = NULL;
+  arena->cur_arena   = NULL;
+  arena->end_arena   = NULL;
+}
+
+/*
+ * EF: arena_destroy - free everything and give the blocks back
+ *
+ * ARGS :-
+ *   arena - arena to destroy, it can be used again after arena_init
+ *
+ * RET
+ */
+void
+arena_destroy(arena_t *arena)
+{
+  list *item;
+
+  while ((item = list_remove_front(&arena->blocks_arena)))
+    free_frame(VIRT_TO_PHYS(list_entry(item, arena_block_t, link_block)));
+
+  arena->blocks_count_arena = 0;
+  arena_reset(arena);
+}
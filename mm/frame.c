@@ -0,0 +1,734 @@
+/* KalioOS (C) 2020 Pranav Bagur */
+
+#include "if/frame.h"
+#include "../common/if/common.h"
+
+/* --------------------------------------------------------------------------
+                         Constants and types
+   -------------------------------------------------------------------------- */
+frame_area_t *frame_glob;
+
+/* --------------------------------------------------------------------------
+                         Static inline functions
+   -------------------------------------------------------------------------- */
+/* === SIF: Mark frames [pfn, pfn + count) as allocated in the bitmap === */
+static inline void
+set_bitmap_range(ub4 pfn, ub4 count)
+{
+  ub4 *bitmap = frame_glob->bitmap_area;
+
+  while (count && (pfn & 31)) {
+    bitmap[pfn >> 5] |= (1 << (pfn & 31));
+    pfn++;
+    count--;
+  }
+
+  /* Whole words at a time for the aligned middle of the range */
+  while (count >= 32) {
+    bitmap[pfn >> 5] = 0xFFFFFFFF;
+    pfn   += 32;
+    count -= 32;
+  }
+
+  while (count) {
+    bitmap[pfn >> 5] |= (1 << (pfn & 31));
+    pfn++;
+    count--;
+  }
+}
+
+/* === SIF: Mark frames [pfn, pfn + count) as free in the bitmap === */
+static inline void
+clr_bitmap_range(ub4 pfn, ub4 count)
+{
+  ub4 *bitmap = frame_glob->bitmap_area;
+
+  while (count && (pfn & 31)) {
+    bitmap[pfn >> 5] &= ~(1 << (pfn & 31));
+    pfn++;
+    count--;
+  }
+
+  while (count >= 32) {
+    bitmap[pfn >> 5] = 0;
+    pfn   += 32;
+    count -= 32;
+  }
+
+  while (count) {
+    bitmap[pfn >> 5] &= ~(1 << (pfn & 31));
+    pfn++;
+    count--;
+  }
+}
+
+/* === SIF: Is frame pfn allocated? === */
+static inline bool
+test_bitmap(ub4 pfn)
+{
+  return !!(frame_glob->bitmap_area[pfn >> 5] & (1 << (pfn & 31)));
+}
+
+/* === SIF: Is a block of 2^order frames free? === */
+static inline bool
+have_free_block(ub4 order)
+{
+  for (; order <= FRAME_MAX_ORDER; order++)
+    if (frame_glob->free_count_area[order])
+      return true;
+
+  return false;
+}
+
+/* === SIF: Put a block of 2^order frames starting at pfn on its free list === */
+static inline void
+push_free_block(ub4 pfn, ub4 order)
+{
+  frame_t *frame = &frame_glob->frames_area[pfn];
+
+  frame->order_frame  = order;
+  frame->flags_frame |= FRAME_FREE;
+
+  /* LIFO - recently freed frames are the most likely to be cache warm */
+  list_add_head(&frame_glob->free_list_area[order], &frame->link_frame);
+  frame_glob->free_count_area[order]++;
+}
+
+/* --------------------------------------------------------------------------
+                         Static functions
+   -------------------------------------------------------------------------- */
+/*
+ * SF: add_free_range - hand frames [start_pfn, end_pfn) to the buddy allocator
+ *
+ * ARGS :-
+ *   start_pfn - first frame
+ *   end_pfn   - one past the last frame
+ *
+ * The range is carved into the largest naturally aligned blocks that fit
+ *
+ * RET
+ */
+static void
+add_free_range(ub4 start_pfn, ub4 end_pfn)
+{
+  ub4 pfn = start_pfn;
+  ub4 idx;
+
+  for (idx = start_pfn; idx < end_pfn; idx++)
+    frame_glob->frames_area[idx].flags_frame &= ~FRAME_RESERVED;
+
+  clr_bitmap_range(start_pfn, end_pfn - start_pfn);
+  frame_glob->free_frames_area  += (end_pfn - start_pfn);
+  frame_glob->total_frames_area += (end_pfn - start_pfn);
+
+  while (pfn < end_pfn) {
+    ub4 order = FRAME_MAX_ORDER;
+
+    while (order && ((pfn & ((1 << order) - 1)) ||
+                     (pfn + (1 << order)) > end_pfn))
+      order--;
+
+    push_free_block(pfn, order);
+    pfn += (1 << order);
+  }
+}
+
+/*
+ * SF: free_frame_range - free the allocated frames [pfn, end_pfn)
+ *
+ * ARGS :-
+ *   pfn     - first frame
+ *   end_pfn - one past the last frame
+ *
+ * The range does not have to be a single block. It is carved into the
+ * largest naturally aligned blocks that fit and each one is freed (and
+ * coalesced) on its own
+ *
+ * RET
+ */
+static void
+free_frame_range(ub4 pfn, ub4 end_pfn)
+{
+  while (pfn < end_pfn) {
+    ub4 order = FRAME_MAX_ORDER;
+
+    while (order && ((pfn & ((1 << order) - 1)) ||
+                     (pfn + (1 << order)) > end_pfn))
+      order--;
+
+    frame_glob->frames_area[pfn].order_frame = order;
+    free_frames(PFN_TO_ADDR(pfn));
+    pfn += (1 << order);
+  }
+}
+
+/* --------------------------------------------------------------------------
+                         Export functions
+   -------------------------------------------------------------------------- */
+/*
+ * EF: size_to_order - smallest order whose block can hold 'size' bytes
+ *
+ * ARGS :-
+ *   size - size in bytes
+ *
+ * RET
+ *   order
+ */
+ub4
+size_to_order(ub4 size)
+{
+  ub4 order = 0;
+
+  while ((PAGE_SIZE << order) < size)
+    order++;
+
+  return order;
+}
+
+/*
+ * EF: alloc_frames - allocate 2^order physically contiguous frames
+ *
+ * ARGS :-
+ *   order - log2 of the number of frames
+ *
+ * RET
+ *   phys addr of the first frame, 0 if we are out of memory
+ */
+ub4
+alloc_frames(ub4 order)
+{
+  ub4      cur = order;
+  ub4      pfn;
+  list    *item;
+  frame_t *frame;
+
+  if (order > FRAME_MAX_ORDER)
+    return 0;
+
+  while (cur <= FRAME_MAX_ORDER && !frame_glob->free_count_area[cur])
+    cur++;
+
+  /* Pre-zeroed frames are the first thing we give up, then caches */
+  if (cur > FRAME_MAX_ORDER) {
+    if (frame_glob->zero_count_area)
+      drain_zero_pool();
+    else if (!shrink_frames(order) || !have_free_block(order))
+      return 0;
+
+    return alloc_frames(order);
+  }
+
+  item = list_remove_front(&frame_glob->free_list_area[cur]);
+  frame_glob->free_count_area[cur]--;
+
+  frame = list_entry(item, frame_t, link_frame);
+  ASSERT((frame->flags_frame & FRAME_FREE));
+  frame->flags_frame &= ~FRAME_FREE;
+  pfn = (ub4)(frame - frame_glob->frames_area);
+
+  /* Split the block, handing the upper halves back */
+  while (cur > order) {
+    cur--;
+    push_free_block(pfn + (1 << cur), cur);
+  }
+
+  frame->order_frame = order;
+  set_bitmap_range(pfn, (1 << order));
+  frame_glob->free_frames_area -= (1 << order);
+
+  return PFN_TO_ADDR(pfn);
+}
+
+/*
+ * EF: free_frames - return a block to the buddy allocator
+ *
+ * ARGS :-
+ *   addr - phys addr returned by alloc_frames
+ *
+ * RET
+ */
+void
+free_frames(ub4 addr)
+{
+  ub4      pfn   = ADDR_TO_PFN(addr);
+  frame_t *frame = &frame_glob->frames_area[pfn];
+  ub4      order = frame->order_frame;
+
+  ASSERT((pfn < frame_glob->nframes_area));
+  ASSERT(test_bitmap(pfn));
+  ASSERT(!(frame->flags_frame & (FRAME_FREE | FRAME_RESERVED)));
+
+  clr_bitmap_range(pfn, (1 << order));
+  frame_glob->free_frames_area += (1 << order);
+
+  /* Coalesce with our buddy for as long as it is free and of our order */
+  while (order < FRAME_MAX_ORDER) {
+    ub4      buddy_pfn = pfn ^ (1 << order);
+    frame_t *buddy;
+
+    if (buddy_pfn >= frame_glob->nframes_area)
+      break;
+
+    buddy = &frame_glob->frames_area[buddy_pfn];
+    if (!(buddy->flags_frame & FRAME_FREE) || buddy->order_frame != order)
+      break;
+
+    list_remove(&frame_glob->free_list_area[order], &buddy->link_frame);
+    frame_glob->free_count_area[order]--;
+    buddy->flags_frame &= ~FRAME_FREE;
+
+    pfn &= ~(1 << order);
+    order++;
+  }
+
+  push_free_block(pfn, order);
+}
+
+/*
+ * EF: alloc_frames_exact - allocate 'count' physically contiguous frames
+ *
+ * ARGS :-
+ *   count - number of frames
+ *
+ * A block of the next power of 2 is allocated and the frames past 'count'
+ * are handed straight back, so a 5 frame run costs 5 frames, not 8
+ *
+ * RET
+ *   phys addr of the first frame, 0 if we are out of memory
+ */
+ub4
+alloc_frames_exact(ub4 count)
+{
+  ub4 order = 0;
+  ub4 addr;
+  ub4 pfn;
+
+  while ((1 << order) < count)
+    order++;
+
+  addr = alloc_frames(order);
+  if (!addr)
+    return 0;
+
+  pfn = ADDR_TO_PFN(addr);
+  if (count < (1 << order)) {
+    free_frame_range(pfn + count, pfn + (1 << order));
+    frame_glob->frames_area[pfn].order_frame = 0;
+  }
+
+  return addr;
+}
+
+/*
+ * EF: free_frames_exact - free a run returned by alloc_frames_exact
+ *
+ * ARGS :-
+ *   addr  - phys addr of the first frame
+ *   count - number of frames (as passed to alloc_frames_exact)
+ *
+ * RET
+ */
+void
+free_frames_exact(ub4 addr, ub4 count)
+{
+  ub4 pfn = ADDR_TO_PFN(addr);
+
+  free_frame_range(pfn, pfn + count);
+}
+
+/*
+ * EF: alloc_frame - allocate a single frame
+ *
+ * ARGS :-
+ *
+ * RET
+ *   phys addr of the frame, 0 if we are out of memory
+ */
+ub4
+alloc_frame(void)
+{
+  return alloc_frames(0);
+}
+
+/*
+ * EF: free_frame - free a single frame
+ *
+ * ARGS :-
+ *   addr - phys addr returned by alloc_frame
+ *
+ * RET
+ */
+void
+free_frame(ub4 addr)
+{
+  free_frames(addr);
+}
+
+/*
+ * EF: alloc_zeroed_frame - allocate a single zeroed frame
+ *
+ * ARGS :-
+ *
+ * RET
+ *   phys addr of the frame, 0 if we are out of memory
+ */
+ub4
+alloc_zeroed_frame(void)
+{
+  list *item;
+  ub4   addr;
+
+  item = list_remove_front(&frame_glob->zero_list_area);
+  if (item) {
+    frame_glob->zero_count_area--;
+    return PFN_TO_ADDR(list_entry(item, frame_t, link_frame) -
+                       frame_glob->frames_area);
+  }
+
+  addr = alloc_frames(0);
+  if (addr)
+    memset((ub1 *)PHYS_TO_VIRT(addr), PAGE_SIZE, 0);
+
+  return addr;
+}
+
+/*
+ * EF: fill_zero_pool - zero one more frame for the zero pool
+ *
+ * ARGS :-
+ *
+ * Meant to be called when there is nothing else to do. Never takes the last
+ * FRAME_ZERO_POOL free frames
+ *
+ * RET
+ *   true iff a frame was added
+ */
+bool
+fill_zero_pool(void)
+{
+  ub4 addr;
+
+  if (frame_glob->zero_count_area >= FRAME_ZERO_POOL ||
+      frame_glob->free_frames_area <= FRAME_ZERO_POOL)
+    return false;
+
+  addr = alloc_frames(0);
+  if (!addr)
+    return false;
+
+  memset((ub1 *)PHYS_TO_VIRT(addr), PAGE_SIZE, 0);
+  list_add_head(&frame_glob->zero_list_area,
+                &frame_glob->frames_area[ADDR_TO_PFN(addr)].link_frame);
+  frame_glob->zero_count_area++;
+  return true;
+}
+
+/*
+ * EF: drain_zero_pool - free every frame of the zero pool
+ *
+ * ARGS :-
+ *
+ * RET
+ *   number of frames freed
+ */
+ub4
+drain_zero_pool(void)
+{
+  ub4   freed = 0;
+  list *item;
+
+  while ((item = list_remove_front(&frame_glob->zero_list_area))) {
+    frame_glob->zero_count_area--;
+    free_frames(PFN_TO_ADDR(list_entry(item, frame_t, link_frame) -
+                            frame_glob->frames_area));
+    freed++;
+  }
+
+  return freed;
+}
+
+/*
+ * EF: register_shrinker - register a reclaim callback
+ *
+ * ARGS :-
+ *   shrinker - name, func and prio must be set, it must stay around until
+ *              it is unregistered
+ *
+ * Shrinkers of the same priority run in the order they were registered
+ *
+ * RET
+ */
+void
+register_shrinker(shrinker_t *shrinker)
+{
+  list *cur;
+
+  shrinker->calls_shrinker = 0;
+  shrinker->freed_shrinker = 0;
+
+  list_for_each(cur, &frame_glob->shrinkers_area) {
+    if (list_entry(cur, shrinker_t, link_shrinker)->prio_shrinker >
+        shrinker->prio_shrinker) {
+      list_add_before(cur, &shrinker->link_shrinker);
+      return;
+    }
+  }
+
+  list_add_tail(&frame_glob->shrinkers_area, &shrinker->link_shrinker);
+}
+
+/*
+ * EF: unregister_shrinker - remove a reclaim callback
+ *
+ * ARGS :-
+ *   shrinker - registered shrinker
+ *
+ * RET
+ */
+void
+unregister_shrinker(shrinker_t *shrinker)
+{
+  list_remove(&frame_glob->shrinkers_area, &shrinker->link_shrinker);
+}
+
+/*
+ * EF: shrink_frames - run the shrinkers
+ *
+ * ARGS :-
+ *   order - stop as soon as a block of this order is free
+ *
+ * Shrinkers may free and even allocate memory, but an allocation that runs
+ * dry while they run fails instead of running them again
+ *
+ * RET
+ *   number of frames the shrinkers released
+ */
+ub4
+shrink_frames(ub4 order)
+{
+  list       *cur;
+  shrinker_t *shrinker;
+  ub4         before;
+  ub4         freed = 0;
+
+  if (frame_glob->shrinking_area)
+    return 0;
+
+  frame_glob->shrinking_area = true;
+  frame_glob->shrink_runs_area++;
+
+  list_for_each(cur, &frame_glob->shrinkers_area) {
+    shrinker = list_entry(cur, shrinker_t, link_shrinker);
+    before   = frame_glob->free_frames_area;
+
+    shrinker->func_shrinker();
+    shrinker->calls_shrinker++;
+
+    /* A shrinker can make others allocate, only count what it gains */
+    if (frame_glob->free_frames_area > before) {
+      shrinker->freed_shrinker += frame_glob->free_frames_area - before;
+      freed                    += frame_glob->free_frames_area - before;
+    }
+
+    if (have_free_block(order))
+      break;
+  }
+
+  frame_glob->shrinking_area = false;
+  return freed;
+}
+
+/*
+ * EF: get_shrink_runs - number of times the shrinkers were run
+ *
+ * ARGS :-
+ *
+ * RET
+ *   shrink_frames calls that got to run the shrinkers
+ */
+ub4
+get_shrink_runs(void)
+{
+  return frame_glob->shrink_runs_area;
+}
+
+/*
+ * EF: frame_in_use - is the frame holding addr allocated (or reserved)?
+ *
+ * ARGS :-
+ *   addr - phys addr
+ *
+ * RET
+ *   true iff allocated
+ */
+bool
+frame_in_use(ub4 addr)
+{
+  ub4 pfn = ADDR_TO_PFN(addr);
+
+  if (pfn >= frame_glob->nframes_area)
+    return true;
+
+  return test_bitmap(pfn);
+}
+
+/*
+ * EF: addr_to_frame - descriptor of the frame holding addr
+ *
+ * ARGS :-
+ *   addr - phys addr
+ *
+ * RET
+ *   frame_t
+ */
+frame_t *
+addr_to_frame(ub4 addr)
+{
+  return &frame_glob->frames_area[ADDR_TO_PFN(addr)];
+}
+
+/*
+ * EF: get_free_frames - number of free frames
+ *
+ * ARGS :-
+ *
+ * RET
+ *   free frames
+ */
+ub4
+get_free_frames(void)
+{
+  return frame_glob->free_frames_area;
+}
+
+/*
+ * EF: get_total_frames - number of managed frames
+ *
+ * ARGS :-
+ *
+ * RET
+ *   managed frames
+ */
+ub4
+get_total_frames(void)
+{
+  return frame_glob->total_frames_area;
+}
+
+/*
+ * EF: get_free_blocks - number of free blocks of an order
+ *
+ * ARGS :-
+ *   order - block order (<= FRAME_MAX_ORDER)
+ *
+ * RET
+ *   # blocks on the free list of that order
+ */
+ub4
+get_free_blocks(ub4 order)
+{
+  return frame_glob->free_count_area[order];
+}
+
+/*
+ * EF: get_zero_pool_frames - number of frames in the zero pool
+ *
+ * ARGS :-
+ *
+ * RET
+ *   # pre-zeroed frames (they count as allocated)
+ */
+ub4
+get_zero_pool_frames(void)
+{
+  return frame_glob->zero_count_area;
+}
+
+/*
+ * EF: get_mem_end - end of physical memory
+ *
+ * ARGS :-
+ *
+ * RET
+ *   highest physical address we manage (exclusive)
+ */
+ub4
+get_mem_end(void)
+{
+  return PFN_TO_ADDR(frame_glob->nframes_area);
+}
+
+/*
+ * EF: frame_init_func - module init function
+ *
+ * ARGS :-
+ *
+ * The descriptors and the bitmap come out of the boot allocator. Everything
+ * it handed out (including them) stays reserved, as does anything that is
+ * not a usable region of the memory map. The rest of memory is given to the
+ * buddy allocator and the boot allocator is sealed.
+ *
+ * RET - TRUE iff successful
+ */
+bool
+frame_init_func(void)
+{
+  ub4 idx;
+  ub4 nregions = get_mem_region_count();
+  ub4 nframes;
+  ub4 boot_end;
+  ub4 sz;
+
+  if (!nregions)
+    return false;
+
+  nframes = ADDR_TO_PFN(get_mem_region(nregions - 1)->end_region);
+
+  frame_glob = (frame_area_t *)kmalloc_mem(sizeof(*frame_glob), false);
+  memset((ub1 *)frame_glob, sizeof(*frame_glob), 0);
+
+  for (idx = 0; idx <= FRAME_MAX_ORDER; idx++)
+    list_init(&frame_glob->free_list_area[idx]);
+  list_init(&frame_glob->zero_list_area);
+  list_init(&frame_glob->shrinkers_area);
+
+  frame_glob->nframes_area = nframes;
+
+  sz = nframes * sizeof(frame_t);
+  frame_glob->frames_area = (frame_t *)kmalloc_mem(sz, false);
+  memset((ub1 *)frame_glob->frames_area, sz, 0);
+  for (idx = 0; idx < nframes; idx++)
+    frame_glob->frames_area[idx].flags_frame = FRAME_RESERVED;
+
+  /* Everything starts out allocated */
+  sz = ((nframes + 31) / 32) * sizeof(ub4);
+  frame_glob->bitmap_area = (ub4 *)kmalloc_mem(sz, false);
+  memset((ub1 *)frame_glob->bitmap_area, sz, 0xFF);
+
+  boot_end = seal_boot_mem();
+  for (idx = 0; idx < nregions; idx++) {
+    mem_region_t *region = get_mem_region(idx);
+    ub4           start  = region->start_region;
+
+    if (start < boot_end)
+      start = boot_end;
+
+    if (start < region->end_region)
+      add_free_range(ADDR_TO_PFN(start), ADDR_TO_PFN(region->end_region));
+  }
+
+  printk_system("Initialized frame allocator..");
+  return true;
+}
+
+/*
+ * EF: frame_exit_func - module exit function
+ *
+ * ARGS :-
+ *
+ * RET
+ */
+void
+frame_exit_func(void)
+{
+}
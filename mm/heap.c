@@ -1,135 +1,438 @@
 /* KalioOS (C) 2020 Pranav Bagur */
 
 #include "if/heap.h"
+#include "if/frame.h"
 
-/* -------------------------------------------------------------------------- 
+/* --------------------------------------------------------------------------
                          Constants and types
-   -------------------------------------------------------------------------- */ 
-ub4     tub_sizes[] = {32, 128, 256, 512, 1024, 4096};
-heap_t *heap_glob;
-ub4     bundle_size;
+   -------------------------------------------------------------------------- */
+ub4     tub_sizes[] = {   8,   16,   24,   32,   40,   48,   56,   64,
+                         80,   96,  112,  128,
+                        144,  160,  176,  192,  208,  224,  240,  256,
+                        288,  320,  352,  384,  416,  448,  480,  512,
+                        576,  640,  704,  768,  832,  896,  960, 1024,
+                       1152, 1280, 1408, 1536, 1664, 1792, 1920, 2048};
+heap_t     *heap_glob;
+shrinker_t  heap_shrinker;
 
-/* -------------------------------------------------------------------------- 
+/* --------------------------------------------------------------------------
+                         Static inline functions
+   -------------------------------------------------------------------------- */
+/* === SIF: Offset of chunk 0 in a bundle holding nchunks chunks === */
+static inline ub4
+bundle_offset(ub4 nchunks)
+{
+  ub4 off = sizeof(bundle_t) + ((nchunks + 31) / 32) * sizeof(ub4) + nchunks;
+
+  return ((off + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1));
+}
+
+/* === SIF: Tub serving sz (sz <= HEAP_MAX_CHUNK) === */
+static inline tub_t *
+size_to_tub(ub4 sz)
+{
+  ub4 slot = (sz + (1 << HEAP_CLASS_SHIFT) - 1) >> HEAP_CLASS_SHIFT;
+
+  return &heap_glob->tubs[heap_glob->tub_index[slot]];
+}
+
+/* === SIF: Address of chunk idx in a bundle === */
+static inline ub4 *
+bundle_chunk(tub_t *tub, bundle_t *bundle, ub4 idx)
+{
+  return (ub4 *)((ub4)bundle + tub->offset_tub + idx * tub->size_tub);
+}
+
+/* === SIF: Index of the chunk at addr in its bundle === */
+static inline ub4
+chunk_index(tub_t *tub, bundle_t *bundle, ub4 *addr)
+{
+  return (((ub4)addr - (ub4)bundle - tub->offset_tub) / tub->size_tub);
+}
+
+/* === SIF: Call site slot bytes of a bundle (one per chunk) === */
+static inline ub1 *
+bundle_sites(tub_t *tub, bundle_t *bundle)
+{
+  return (ub1 *)&bundle->map_bundle[tub->map_words_tub];
+}
+
+/* === SIF: Grab the lowest free chunk of a bundle, returns its index === */
+static inline ub4
+bundle_take_chunk(tub_t *tub, bundle_t *bundle)
+{
+  ub4 word = bundle->hint_bundle;
+  ub4 bit;
+
+  /* Everything below the hint is in use */
+  while (bundle->map_bundle[word] == 0xFFFFFFFF)
+    word++;
+
+  bit = __builtin_ctz(~bundle->map_bundle[word]);
+  bundle->map_bundle[word] |= (1 << bit);
+  bundle->hint_bundle = word;
+
+  return (word * 32 + bit);
+}
+
+/* === SIF: Release chunk idx of a bundle === */
+static inline void
+bundle_put_chunk(bundle_t *bundle, ub4 idx)
+{
+  ub4 word = idx / 32;
+
+  ASSERT((bundle->map_bundle[word] & (1 << (idx % 32))));
+  bundle->map_bundle[word] &= ~(1 << (idx % 32));
+
+  if (word < bundle->hint_bundle)
+    bundle->hint_bundle = word;
+}
+
+#ifdef HEAP_HARDEN
+/* === SIF: Fill a free chunk with poison === */
+static inline void
+chunk_poison(tub_t *tub, ub4 *addr)
+{
+  memset((ub1 *)addr, tub->size_tub, HEAP_POISON_BYTE);
+}
+#endif
+
+/* --------------------------------------------------------------------------
                          Static functions
-   -------------------------------------------------------------------------- */ 
-/* 
- * SF: add_bundles - Add more bundles to the heap
- * 
+   -------------------------------------------------------------------------- */
+#ifdef HEAP_HARDEN
+/*
+ * SF: heap_corrupt - report heap corruption and stop
+ *
  * ARGS :-
- *   nbundles - # bundles to add
+ *   what - what we found
+ *   addr - where we found it
  *
  * RET
- *   true if successful
  */
-static bool
-add_bundles(ub4 nbundles)
+static void
+heap_corrupt(ub1 *what, void *addr)
 {
-  /* Allocate a page */
-  ub4       idx;
-  bundle_t *bundle;
-  ub4      *bundle_mem; 
+  printk_attr(what, RED_ON_BLACK);
+  printk_hex_attr((ub4)addr, RED_ON_BLACK);
+  printk_attr("\n", RED_ON_BLACK);
+  PANIC("Heap corruption");
+}
 
-  if ((heap_glob->total_bundles + nbundles) > MAX_BUNDLES)
-    return false;
+/*
+ * SF: chunk_check_poison - make sure nobody wrote to a free chunk
+ *
+ * ARGS :-
+ *   tub  - tub of the chunk
+ *   addr - free chunk
+ *
+ * RET
+ */
+static void
+chunk_check_poison(tub_t *tub, ub4 *addr)
+{
+  ub4 pattern = HEAP_POISON_BYTE * 0x01010101u;
+  ub4 idx;
 
-  bundle_mem = (ub4 *)kmalloc(PAGE_SIZE);
-  memset((ub1 *)bundle_mem, PAGE_SIZE, 0);
-  bundle = (bundle_t *)bundle_mem;
+  /* Tub sizes are multiples of 8 */
+  for (idx = 0; idx < tub->size_tub / sizeof(ub4); idx++)
+    if (addr[idx] != pattern)
+      heap_corrupt("Write after free at ", &addr[idx]);
+}
 
-  /* Carve out nbundles from the allocated page */
-  for (idx = 0; idx < nbundles; idx++, bundle++) {
-    list_init(&bundle->chunks_bundle);
-    bundle->chunks_count_bundle  = 0;
-    bundle->chunks_in_use_bundle = 0;
-    bundle->mem_bundle           = NULL; /* Lazy allocation */
+/*
+ * SF: chunk_guard - set up the redzones of a chunk being handed out
+ *
+ * ARGS :-
+ *   tub  - tub of the chunk
+ *   addr - chunk
+ *   sz   - size the caller asked for
+ *
+ * RET
+ *   address for the caller
+ */
+static ub4 *
+chunk_guard(tub_t *tub, ub4 *addr, ub4 sz)
+{
+  addr[0] = sz;
+  addr[1] = HEAP_RZ_BYTE * 0x01010101u;
+  memset((ub1 *)addr + HEAP_RZ_HEAD + sz, tub->size_tub - HEAP_RZ_HEAD - sz,
+         HEAP_RZ_BYTE);
 
-    list_add_tail(&heap_glob->free_bundles_heap, &bundle->link_heap_bundle);
-    heap_glob->free_bundles_count++;
+  return (addr + HEAP_RZ_HEAD / sizeof(ub4));
+}
 
-    heap_glob->total_bundles++;
+/*
+ * SF: chunk_unguard - check the redzones of a chunk being freed
+ *
+ * ARGS :-
+ *   tub  - tub of the chunk
+ *   addr - address the caller got
+ *
+ * A poisoned canary means the chunk was already freed
+ *
+ * RET
+ *   address of the chunk
+ */
+static ub4 *
+chunk_unguard(tub_t *tub, ub4 *addr)
+{
+  ub4 *chunk = addr - HEAP_RZ_HEAD / sizeof(ub4);
+  ub1 *tail;
+  ub4  len;
+
+  if (chunk[1] == HEAP_POISON_BYTE * 0x01010101u)
+    heap_corrupt("Double free of ", addr);
+
+  if (chunk[1] != HEAP_RZ_BYTE * 0x01010101u ||
+      chunk[0] > tub->size_tub - HEAP_RZ_EXTRA)
+    heap_corrupt("Underflow before ", addr);
+
+  tail = (ub1 *)addr + chunk[0];
+  len  = tub->size_tub - HEAP_RZ_HEAD - chunk[0];
+  while (len--)
+    if (*tail++ != HEAP_RZ_BYTE)
+      heap_corrupt("Overflow at ", tail - 1);
+
+  return chunk;
+}
+
+/*
+ * SF: heap_quarantine - hold a freed chunk back from reuse
+ *
+ * ARGS :-
+ *   tub  - tub of the chunk
+ *   addr - poisoned chunk, NULL to just evict the oldest one
+ *
+ * RET
+ *   the oldest chunk once the FIFO is full (its poison checked), else NULL
+ */
+static ub4 *
+heap_quarantine(tub_t *tub, ub4 *addr)
+{
+  ub4 *old = NULL;
+  ub4  slot;
+
+  if (heap_glob->quarantine_count_heap == HEAP_QUARANTINE || !addr) {
+    if (!heap_glob->quarantine_count_heap)
+      return NULL;
+
+    old = heap_glob->quarantine_heap[heap_glob->quarantine_head_heap];
+    heap_glob->quarantine_head_heap = (heap_glob->quarantine_head_heap + 1) %
+                                      HEAP_QUARANTINE;
+    heap_glob->quarantine_count_heap--;
+
+    addr_to_bundle(old)->tub_bundle->cached_tub--;
+    chunk_check_poison(addr_to_bundle(old)->tub_bundle, old);
   }
 
-  return true;
+  if (addr) {
+    slot = (heap_glob->quarantine_head_heap +
+            heap_glob->quarantine_count_heap) % HEAP_QUARANTINE;
+    heap_glob->quarantine_heap[slot] = addr;
+    heap_glob->quarantine_count_heap++;
+    tub->cached_tub++;
+  }
+
+  return old;
 }
+#endif
 
-/* 
+/*
+ * SF: heap_prof_slot - Find (or claim) the profiler slot of a call site
+ *
+ * ARGS :-
+ *   caller - return address of the allocation call
+ *   tub    - index of the tub
+ *
+ * RET
+ *   slot index, 0 (the catch-all) if the table is too full
+ */
+static ub1
+heap_prof_slot(ub4 caller, ub4 tub)
+{
+  heap_site_t *site;
+  ub4          slot = ((caller >> 2) ^ (caller >> 12) ^ (tub << 3));
+  ub4          probe;
+
+  for (probe = 0; probe < HEAP_PROF_PROBES; probe++, slot++) {
+    slot &= (HEAP_PROF_SITES - 1);
+    if (!slot)
+      continue;
+
+    site = &heap_glob->sites_heap[slot];
+    if (site->caller_site == caller && site->tub_site == tub)
+      return slot;
+
+    if (!site->caller_site) {
+      site->caller_site = caller;
+      site->tub_site    = tub;
+      heap_glob->sites_count_heap++;
+      return slot;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * SF: heap_prof_charge - charge a chunk to a call site
+ *
+ * ARGS :-
+ *   addr   - chunk being handed out
+ *   caller - return address of the allocation call
+ *
+ * RET
+ */
+static void
+heap_prof_charge(ub4 *addr, ub4 caller)
+{
+  bundle_t    *bundle = addr_to_bundle(addr);
+  tub_t       *tub    = bundle->tub_bundle;
+  heap_site_t *site;
+  ub1          slot;
+
+  slot = heap_prof_slot(caller, tub - heap_glob->tubs);
+  bundle_sites(tub, bundle)[chunk_index(tub, bundle, addr)] = slot;
+
+  site = &heap_glob->sites_heap[slot];
+  site->live_bytes_site += tub->size_tub;
+  site->live_count_site++;
+  site->allocs_site++;
+}
+
+/*
+ * SF: heap_prof_uncharge - take a chunk off its call site
+ *
+ * ARGS :-
+ *   addr - chunk being freed
+ *
+ * RET
+ */
+static void
+heap_prof_uncharge(ub4 *addr)
+{
+  bundle_t    *bundle = addr_to_bundle(addr);
+  tub_t       *tub    = bundle->tub_bundle;
+  heap_site_t *site;
+
+  site = &heap_glob->sites_heap[bundle_sites(tub, bundle)
+                                [chunk_index(tub, bundle, addr)]];
+  site->live_bytes_site -= tub->size_tub;
+  site->live_count_site--;
+}
+
+/*
  * SF: init_tub - Initialize tub
- * 
+ *
  * ARGS :-
  *   tub - tub to initialize
  *   sz  - chunk size
  *
+ * Works out how many chunks (and map words) fit in a bundle next to the
+ * bundle descriptor
+ *
  * RET
  */
 static void
 init_tub(tub_t *tub, ub4 sz)
 {
-  list_init(&tub->bundles_tub);
-  tub->bundles_count_tub = 0;
+  ub4 nchunks = (BUNDLE_SIZE - sizeof(bundle_t)) / sz;
+
+  while (bundle_offset(nchunks) + nchunks * sz > BUNDLE_SIZE)
+    nchunks--;
+
+  list_init(&tub->avl_bundles_tub);
+  tub->avl_bundles_count_tub = 0;
+  tub->bundles_count_tub     = 0;
+
+  list_init(&tub->empty_bundles_tub);
+  tub->empty_count_tub = 0;
+  tub->low_wm_tub      = HEAP_EMPTY_LOW_WM;
+  tub->high_wm_tub     = HEAP_EMPTY_HIGH_WM;
 
-  list_init(&tub->avl_chunks_tub);
   tub->avl_chunks_count_tub = 0;
+  tub->total_in_use_tub     = 0;
+  tub->total_tub            = 0;
+
+  tub->allocs_tub  = 0;
+  tub->frees_tub   = 0;
+  tub->grows_tub   = 0;
+  tub->shrinks_tub = 0;
+
+  list_init(&tub->full_mags_tub);
+  list_init(&tub->empty_mags_tub);
+  tub->full_mags_count_tub  = 0;
+  tub->empty_mags_count_tub = 0;
+  tub->cached_tub           = 0;
 
-  tub->total_in_use_tub = 0;
-  tub->total_tub = 0;
+  /* Small chunks get deep magazines, big ones just a couple of rounds */
+  tub->mag_rounds_tub = HEAP_MAG_BYTES / sz;
+  if (tub->mag_rounds_tub > HEAP_MAG_ROUNDS)
+    tub->mag_rounds_tub = HEAP_MAG_ROUNDS;
+  if (tub->mag_rounds_tub < HEAP_MAG_MIN)
+    tub->mag_rounds_tub = HEAP_MAG_MIN;
 
-  tub->size_tub = sz;
+  tub->size_tub              = sz;
+  tub->chunks_per_bundle_tub = nchunks;
+  tub->map_words_tub         = (nchunks + 31) / 32;
+  tub->offset_tub            = bundle_offset(nchunks);
 }
 
-/* 
- * SF: grow_tub - add free chunks to the tub
- * 
+/*
+ * SF: grow_tub - add a bundle of free chunks to the tub
+ *
  * ARGS :-
  *   tub - tub to grow
  *
+ * The new bundle goes on the empty list
+ *
  * RET
  *   true if we have a bundle to grab
  */
 static bool
 grow_tub(tub_t *tub)
 {
-  list     *item;
   bundle_t *bundle;
-  ub4       chunk_sz;
-  ub4       cur_off;
+  ub4       nchunks = tub->chunks_per_bundle_tub;
+  ub4       idx;
+  ub4       addr;
 
-  if (!heap_glob->free_bundles_count && 
-      !add_bundles(GROW_BUNDLES_LIMIT))
-      return false;
+  if (heap_glob->total_bundles >= heap_glob->max_bundles)
+    return false;
 
-  item  = list_remove_front(&heap_glob->free_bundles_heap);
-  heap_glob->free_bundles_count--;
+  addr = alloc_frames(BUNDLE_ORDER);
+  if (!addr)
+    return false;
 
-  bundle = list_entry(item, bundle_t, link_heap_bundle);
-  if (!bundle->mem_bundle)
-    bundle->mem_bundle = (ub4 *)kmalloc(bundle_size);
+  bundle = (bundle_t *)PHYS_TO_VIRT(addr);
 
-  list_add_tail(&heap_glob->in_use_bundles_heap, &bundle->link_heap_bundle);
-  heap_glob->in_use_bundles_count++;
+  bundle->magic_bundle         = MAGIC_BUNDLE;
+  bundle->tub_bundle           = tub;
+  bundle->chunks_count_bundle  = nchunks;
+  bundle->chunks_in_use_bundle = 0;
+  bundle->hint_bundle          = 0;
 
-  list_add_tail(&tub->bundles_tub, &bundle->link_tub_bundle);
-  tub->bundles_count_tub++;
+  for (idx = 0; idx < tub->map_words_tub; idx++)
+    bundle->map_bundle[idx] = 0;
 
-  chunk_sz = (sizeof(chunk_t) + tub->size_tub);
-  cur_off  = 0;
+  /* Bits past the last chunk must never look free */
+  if (nchunks % 32)
+    bundle->map_bundle[nchunks / 32] = ~((1 << (nchunks % 32)) - 1);
 
-  while((cur_off + chunk_sz) <= bundle_size) {
-    chunk_t *chunk = (chunk_t *)((ub4)bundle->mem_bundle + cur_off);
-    chunk->magic_chunk      = MAGIC_CHUNK;
-    chunk->in_use_chunk     = false;
-    chunk->size_chunk       = tub->size_tub; 
-    chunk->bp_tub_chunk     = tub;
-    chunk->bp_bundle_chunk  = bundle;
-
-    list_add_tail(&bundle->chunks_bundle, &chunk->link_bundle_chunk);
-    bundle->chunks_count_bundle++;
+#ifdef HEAP_HARDEN
+  for (idx = 0; idx < nchunks; idx++)
+    chunk_poison(tub, bundle_chunk(tub, bundle, idx));
+#endif
 
-    list_add_tail(&tub->avl_chunks_tub, &chunk->link_avl_chunk);
-    tub->avl_chunks_count_tub++;
+  list_add_head(&tub->empty_bundles_tub, &bundle->link_tub_bundle);
+  tub->empty_count_tub++;
+  tub->bundles_count_tub++;
 
-    tub->total_tub++;
-    cur_off += chunk_sz;
-  }
+  tub->avl_chunks_count_tub += nchunks;
+  tub->total_tub            += nchunks;
+  tub->grows_tub++;
+  heap_glob->total_bundles++;
 
 #ifdef DEBUG
   printk("finished growing tub ");
@@ -141,54 +444,40 @@ grow_tub(tub_t *tub)
   return true;
 }
 
-/* 
- * SF: shrink_tub - free chunks back to the pool
- * 
+/*
+ * SF: shrink_tub - free cached empty bundles back to the frame allocator
+ *
  * ARGS :-
- *   tub    - tub to shrink
- *   bundle - bundle reserved for the tub to be released
- *            back to the pool
+ *   tub  - tub to shrink
+ *   keep - # empty bundles to keep cached
+ *
+ * The coldest bundles (tail of the empty list) go first. Bundles are not
+ * zeroed, chunks are zeroed when they are handed out
  *
  * RET
  */
 static void
-shrink_tub(tub_t *tub, bundle_t *bundle)
+shrink_tub(tub_t *tub, ub4 keep)
 {
-  list *item;
-
-  ASSERT((bundle->chunks_in_use_bundle == 0));
-  while (bundle->chunks_count_bundle) {
-    chunk_t *chunk;
+  bundle_t *bundle;
 
-    item = list_remove_front(&bundle->chunks_bundle);
-    bundle->chunks_count_bundle--;
+  while (tub->empty_count_tub > keep) {
+    bundle = list_entry(tub->empty_bundles_tub.prev, bundle_t,
+                        link_tub_bundle);
+    ASSERT((bundle->chunks_in_use_bundle == 0));
 
-    chunk = list_entry(item, chunk_t, link_bundle_chunk);
-    ASSERT(!chunk->in_use_chunk);
-    ASSERT((chunk->magic_chunk == MAGIC_CHUNK));
+    list_remove(&tub->empty_bundles_tub, &bundle->link_tub_bundle);
+    tub->empty_count_tub--;
+    tub->bundles_count_tub--;
 
-    list_remove(&tub->avl_chunks_tub, &chunk->link_avl_chunk);
-    tub->avl_chunks_count_tub--;
-    tub->total_tub--;
+    tub->avl_chunks_count_tub -= bundle->chunks_count_bundle;
+    tub->total_tub            -= bundle->chunks_count_bundle;
+    tub->shrinks_tub++;
+    heap_glob->total_bundles--;
 
-    chunk->bp_bundle_chunk = NULL;
-    chunk->bp_tub_chunk    = NULL;
+    bundle->magic_bundle = 0;
+    free_frames(VIRT_TO_PHYS(bundle));
   }
-  
-  list_remove(&tub->bundles_tub, &bundle->link_tub_bundle);
-  tub->bundles_count_tub--;
-
-  list_remove(&heap_glob->in_use_bundles_heap, &bundle->link_heap_bundle);
-  heap_glob->in_use_bundles_count--;
-
-  /* 
-   * We don't have a mechanism to release mem_bundle
-   * Just push this bundle to the front so that this
-   * is picked up next
-   */
-  memset((ub1 *)bundle->mem_bundle, bundle_size, 0);
-  list_add_tail(&heap_glob->free_bundles_heap, &bundle->link_heap_bundle);
-  heap_glob->free_bundles_count++;
 
 #ifdef DEBUG
   printk("finished shrinking the tub ");
@@ -199,55 +488,86 @@ shrink_tub(tub_t *tub, bundle_t *bundle)
 #endif
 }
 
-/* -------------------------------------------------------------------------- 
-                         Export functions
-   -------------------------------------------------------------------------- */ 
+/*
+ * SF: refill_tub - get a bundle with a free chunk on the avl list
+ *
+ * ARGS :-
+ *   tub - tub to refill
+ *
+ * Cached empty bundles are used before growing the tub. If the heap is at
+ * its bundle limit the magazines are emptied and the other tubs give up
+ * their cached bundles first
+ *
+ * RET
+ *   true iff the avl list is not empty
+ */
+static bool
+refill_tub(tub_t *tub)
+{
+  ub4   idx;
+  list *item;
 
-/* 
- * EF: kmalloc_heap - allocate heap memory
- * 
+  if (!tub->empty_count_tub && !grow_tub(tub)) {
+    heap_mag_reap();
+    if (tub->avl_bundles_count_tub)
+      return true;
+
+    for (idx = 0; idx < N_TUBS; idx++)
+      if (&heap_glob->tubs[idx] != tub)
+        shrink_tub(&heap_glob->tubs[idx], 0);
+
+    if (!tub->empty_count_tub && !grow_tub(tub))
+      return false;
+  }
+
+  item = list_remove_front(&tub->empty_bundles_tub);
+  tub->empty_count_tub--;
+
+  list_add_head(&tub->avl_bundles_tub, item);
+  tub->avl_bundles_count_tub++;
+  return true;
+}
+
+/*
+ * SF: tub_alloc - take a chunk out of a tub
+ *
  * ARGS :-
- *   sz - required size
+ *   tub - tub to allocate from
+ *
+ * The chunk is neither zeroed nor charged to a call site
  *
  * RET
- *   address of allocated memory
+ *   address of the chunk, NULL if the heap is exhausted
  */
-ub4 *kmalloc_heap(ub4 sz)
+static ub4 *
+tub_alloc(tub_t *tub)
 {
-  ub4       tub_idx = 0;
-  tub_t    *tub;
-  list     *item;
-  chunk_t  *chunk;
   ub4      *addr;
+  ub4       idx;
   bundle_t *bundle;
 
-  ASSERT((sz < tub_sizes[N_TUBS - 1]));
-
-  // find the right tub to pick chunk up from
-  while(sz > tub_sizes[tub_idx]) 
-    tub_idx++;
-
-  tub = &heap_glob->tubs[tub_idx];
-  if (!tub->avl_chunks_count_tub && 
-      !grow_tub(tub))
+  if (!tub->avl_bundles_count_tub &&
+      !refill_tub(tub))
     return NULL;
 
-  ASSERT(tub->avl_chunks_count_tub);
+  bundle = list_entry(tub->avl_bundles_tub.next, bundle_t, link_tub_bundle);
+  ASSERT((bundle->magic_bundle == MAGIC_BUNDLE));
 
-  item  = list_remove_front(&tub->avl_chunks_tub);
-  tub->avl_chunks_count_tub--;
+  idx  = bundle_take_chunk(tub, bundle);
+  addr = bundle_chunk(tub, bundle, idx);
+#ifdef HEAP_HARDEN
+  chunk_check_poison(tub, addr);
+#endif
 
-  chunk = list_entry(item, chunk_t, link_avl_chunk);
-  ASSERT((chunk->in_use_chunk == false));
-  ASSERT((chunk->magic_chunk == MAGIC_CHUNK));
-  addr  = (ub4 *)((ub4)chunk + sizeof(chunk_t));
-  memset((ub1 *)addr, chunk->size_chunk, 0);
- 
-  chunk->in_use_chunk = true;
+  bundle->chunks_in_use_bundle++;
+  tub->avl_chunks_count_tub--;
   tub->total_in_use_tub++;
 
-  bundle = (bundle_t *)chunk->bp_bundle_chunk;
-  bundle->chunks_in_use_bundle++;
+  /* Full bundles are not on any list, tub_free finds them by address */
+  if (bundle->chunks_in_use_bundle == bundle->chunks_count_bundle) {
+    list_remove(&tub->avl_bundles_tub, &bundle->link_tub_bundle);
+    tub->avl_bundles_count_tub--;
+  }
 
 #ifdef DEBUG
   printk("finished malloc ");
@@ -255,7 +575,7 @@ ub4 *kmalloc_heap(ub4 sz)
   printk(": ");
   printk_num(tub->avl_chunks_count_tub);
   printk(": ");
-  printk_num((ub4)chunk);
+  printk_num((ub4)bundle);
   printk(": ");
   printk_num((ub4)addr);
   printk("\n");
@@ -264,55 +584,601 @@ ub4 *kmalloc_heap(ub4 sz)
   return addr;
 }
 
-/* 
- * EF: kfree_heap - free heap memory
- * 
+/*
+ * SF: tub_free - give a chunk back to its tub
+ *
  * ARGS :-
- *   addr - address of allocated memory
+ *   addr - chunk to free
  *
  * RET
  */
-void
-kfree_heap(ub4 *addr)
+static void
+tub_free(ub4 *addr)
 {
-  chunk_t  *chunk;
-  tub_t    *tub; 
-  bundle_t *bundle;
+  bundle_t *bundle = addr_to_bundle(addr);
+  tub_t    *tub;
+
+  ASSERT((bundle->magic_bundle == MAGIC_BUNDLE));
+  tub = bundle->tub_bundle;
+  bundle_put_chunk(bundle, chunk_index(tub, bundle, addr));
+#ifdef HEAP_HARDEN
+  chunk_poison(tub, addr);
+#endif
 
-  chunk = (chunk_t *) ((ub4)addr - sizeof(chunk_t));
-  ASSERT(chunk->magic_chunk == MAGIC_CHUNK);
-  ASSERT(chunk->in_use_chunk);
-  
-  chunk->in_use_chunk = false;
-  tub = (tub_t *)chunk->bp_tub_chunk;
-  list_add_tail(&tub->avl_chunks_tub, &chunk->link_avl_chunk);
+  /* A full bundle has a free chunk again */
+  if (bundle->chunks_in_use_bundle == bundle->chunks_count_bundle) {
+    list_add_head(&tub->avl_bundles_tub, &bundle->link_tub_bundle);
+    tub->avl_bundles_count_tub++;
+  }
+
+  bundle->chunks_in_use_bundle--;
   tub->avl_chunks_count_tub++;
   tub->total_in_use_tub--;
 
-  bundle = (bundle_t *)chunk->bp_bundle_chunk;
-  bundle->chunks_in_use_bundle--;
+  /* Cache the empty bundle, trim the cache once it is past the high mark */
+  if (!bundle->chunks_in_use_bundle) {
+    list_remove(&tub->avl_bundles_tub, &bundle->link_tub_bundle);
+    tub->avl_bundles_count_tub--;
+
+    list_add_head(&tub->empty_bundles_tub, &bundle->link_tub_bundle);
+    tub->empty_count_tub++;
 
-  /* TODO Need some watermark algo here */
-  if (!bundle->chunks_in_use_bundle)
-    shrink_tub(tub, bundle);
+    if (tub->empty_count_tub > tub->high_wm_tub)
+      shrink_tub(tub, tub->low_wm_tub);
+  }
 
-  
 #ifdef DEBUG
   printk("finished free ");
   printk_num(tub->size_tub);
   printk(", ");
   printk_num(tub->avl_chunks_count_tub);
   printk(", ");
-  printk_num((ub4)chunk);
+  printk_num((ub4)bundle);
   printk(", ");
   printk_num((ub4)addr);
   printk("\n");
 #endif
 }
 
-/* 
+/*
+ * SF: mag_new - allocate an empty magazine
+ *
+ * ARGS :-
+ *
+ * Magazines are chunks themselves, taken straight from their tub so that
+ * this never recurses into the magazine layer. They are charged to mag_new
+ * in the profiler
+ *
+ * RET
+ *   the magazine, NULL if the heap is exhausted
+ */
+static magazine_t *
+mag_new(void)
+{
+  magazine_t *mag = (magazine_t *)tub_alloc(size_to_tub(sizeof(magazine_t)));
+
+  if (!mag)
+    return NULL;
+
+  heap_prof_charge((ub4 *)mag, (ub4)mag_new);
+  mag->rounds_mag = 0;
+  heap_glob->mags_heap++;
+  return mag;
+}
+
+/*
+ * SF: mag_delete - free an empty magazine
+ *
+ * ARGS :-
+ *   mag - magazine to free
+ *
+ * RET
+ */
+static void
+mag_delete(magazine_t *mag)
+{
+  ASSERT((mag->rounds_mag == 0));
+
+  heap_prof_uncharge((ub4 *)mag);
+  tub_free((ub4 *)mag);
+  heap_glob->mags_heap--;
+}
+
+/*
+ * SF: mag_drain - give every chunk in a magazine back to the tub
+ *
+ * ARGS :-
+ *   tub - tub the magazine caches
+ *   mag - magazine to empty
+ *
+ * RET
+ */
+static void
+mag_drain(tub_t *tub, magazine_t *mag)
+{
+  while (mag->rounds_mag) {
+    tub_free((ub4 *)mag->objs_mag[--mag->rounds_mag]);
+    tub->cached_tub--;
+  }
+}
+
+/*
+ * SF: depot_put_empty - park an empty magazine in the depot
+ *
+ * ARGS :-
+ *   tub - tub the magazine caches
+ *   mag - empty magazine
+ *
+ * Past HEAP_DEPOT_EMPTY the magazine is freed instead
+ *
+ * RET
+ */
+static void
+depot_put_empty(tub_t *tub, magazine_t *mag)
+{
+  if (tub->empty_mags_count_tub >= HEAP_DEPOT_EMPTY) {
+    mag_delete(mag);
+    return;
+  }
+
+  list_add_head(&tub->empty_mags_tub, &mag->link_mag);
+  tub->empty_mags_count_tub++;
+}
+
+/*
+ * SF: depot_put_full - park a full magazine in the depot
+ *
+ * ARGS :-
+ *   tub - tub the magazine caches
+ *   mag - full magazine
+ *
+ * Past HEAP_DEPOT_FULL the coldest full magazine goes back to the tub
+ *
+ * RET
+ */
+static void
+depot_put_full(tub_t *tub, magazine_t *mag)
+{
+  list_add_head(&tub->full_mags_tub, &mag->link_mag);
+  tub->full_mags_count_tub++;
+
+  if (tub->full_mags_count_tub > HEAP_DEPOT_FULL) {
+    mag = list_entry(tub->full_mags_tub.prev, magazine_t, link_mag);
+    list_remove(&tub->full_mags_tub, &mag->link_mag);
+    tub->full_mags_count_tub--;
+
+    mag_drain(tub, mag);
+    depot_put_empty(tub, mag);
+  }
+}
+
+/*
+ * SF: mag_alloc - take a chunk from this CPU's magazines
+ *
+ * ARGS :-
+ *   tub - tub to allocate from
+ *   cm  - this CPU's magazines for tub
+ *
+ * The loaded magazine is tried first, then the previous one. If both are
+ * empty the previous one is traded for a full magazine from the depot
+ *
+ * RET
+ *   address of the chunk, NULL if there is nothing cached
+ */
+static ub4 *
+mag_alloc(tub_t *tub, cpu_mags_t *cm)
+{
+  magazine_t *mag = cm->loaded_mag;
+
+  if (!mag || !mag->rounds_mag) {
+    if (cm->prev_mag && cm->prev_mag->rounds_mag) {
+      cm->loaded_mag = cm->prev_mag;
+      cm->prev_mag   = mag;
+    } else {
+      if (!tub->full_mags_count_tub)
+        return NULL;
+
+      if (cm->prev_mag)
+        depot_put_empty(tub, cm->prev_mag);
+      cm->prev_mag = mag;
+
+      cm->loaded_mag = list_entry(list_remove_front(&tub->full_mags_tub),
+                                  magazine_t, link_mag);
+      tub->full_mags_count_tub--;
+    }
+    mag = cm->loaded_mag;
+  }
+
+  tub->cached_tub--;
+  return (ub4 *)mag->objs_mag[--mag->rounds_mag];
+}
+
+/*
+ * SF: mag_free - put a chunk in this CPU's magazines
+ *
+ * ARGS :-
+ *   tub  - tub the chunk belongs to
+ *   cm   - this CPU's magazines for tub
+ *   addr - chunk to free
+ *
+ * Mirror of mag_alloc. If both magazines are full the previous one goes
+ * to the depot and an empty one takes its place
+ *
+ * RET
+ *   false if no magazine could take the chunk
+ */
+static bool
+mag_free(tub_t *tub, cpu_mags_t *cm, ub4 *addr)
+{
+  magazine_t *mag = cm->loaded_mag;
+
+  if (!mag || mag->rounds_mag == tub->mag_rounds_tub) {
+    if (cm->prev_mag && cm->prev_mag->rounds_mag < tub->mag_rounds_tub) {
+      cm->loaded_mag = cm->prev_mag;
+      cm->prev_mag   = mag;
+    } else {
+      if (tub->empty_mags_count_tub) {
+        mag = list_entry(list_remove_front(&tub->empty_mags_tub),
+                         magazine_t, link_mag);
+        tub->empty_mags_count_tub--;
+      } else if (!(mag = mag_new()))
+        return false;
+
+      /* mag_new can end up in heap_mag_reap, which unloads this CPU */
+      if (cm->prev_mag)
+        depot_put_full(tub, cm->prev_mag);
+      cm->prev_mag   = cm->loaded_mag;
+      cm->loaded_mag = mag;
+    }
+    mag = cm->loaded_mag;
+  }
+
+  mag->objs_mag[mag->rounds_mag++] = addr;
+  tub->cached_tub++;
+  return true;
+}
+
+/*
+ * SF: heap_shrink - heap shrinker
+ *
+ * ARGS :-
+ *
+ * Empties the magazines, then hands every cached empty bundle back
+ *
+ * RET
+ */
+static void
+heap_shrink(void)
+{
+  ub4 idx;
+
+  heap_mag_reap();
+  for (idx = 0; idx < N_TUBS; idx++)
+    shrink_tub(&heap_glob->tubs[idx], 0);
+}
+
+/*
+ * SF: kmalloc_large - allocate a run of whole frames
+ *
+ * ARGS :-
+ *   sz    - required size (bigger than the largest tub)
+ *   flags - HEAP_ZERO/HEAP_NOZERO
+ *
+ * There is no chunk header. The run length lives in the descriptor of the
+ * first frame, which is also how kfree_heap tells a large allocation apart
+ *
+ * RET
+ *   address of allocated memory
+ */
+static ub4 *
+kmalloc_large(ub4 sz, ub4 flags)
+{
+  ub4      nframes = (sz + PAGE_SIZE - 1) / PAGE_SIZE;
+  ub4      addr;
+  frame_t *frame;
+
+  /* A single zeroed frame comes out of the zero pool */
+  if (nframes == 1 && (flags & HEAP_ZERO)) {
+    addr  = alloc_zeroed_frame();
+    flags = HEAP_NOZERO;
+  }
+  else
+    addr = alloc_frames_exact(nframes);
+
+  if (!addr)
+    return NULL;
+
+  frame = addr_to_frame(addr);
+  frame->flags_frame |= FRAME_HEAP_LARGE;
+  frame->run_frame    = nframes;
+
+  heap_glob->large_allocs_heap++;
+  heap_glob->large_frames_heap += nframes;
+
+  if (flags & HEAP_ZERO)
+    memset((ub1 *)PHYS_TO_VIRT(addr), sz, 0);
+
+  return (ub4 *)PHYS_TO_VIRT(addr);
+}
+
+/*
+ * SF: kfree_large - free a run allocated by kmalloc_large
+ *
+ * ARGS :-
+ *   addr  - address of allocated memory
+ *   frame - descriptor of its first frame
+ *
+ * RET
+ */
+static void
+kfree_large(ub4 *addr, frame_t *frame)
+{
+  ub4 nframes = frame->run_frame;
+
+  frame->flags_frame &= ~FRAME_HEAP_LARGE;
+  frame->run_frame    = 0;
+
+  heap_glob->large_allocs_heap--;
+  heap_glob->large_frames_heap -= nframes;
+
+  free_frames_exact(VIRT_TO_PHYS(addr), nframes);
+}
+
+/*
+ * SF: heap_alloc - allocate heap memory
+ *
+ * ARGS :-
+ *   sz     - required size
+ *   flags  - HEAP_ZERO, HEAP_NOZERO
+ *   caller - call site the chunk is charged to
+ *
+ * RET
+ *   address of allocated memory
+ */
+static ub4 *
+heap_alloc(ub4 sz, ub4 flags, ub4 caller)
+{
+  tub_t      *tub;
+  cpu_mags_t *cm;
+  ub4        *addr;
+
+  if (sz + HEAP_RZ_EXTRA > HEAP_MAX_CHUNK)
+    return kmalloc_large(sz, flags);
+
+  tub = size_to_tub(sz + HEAP_RZ_EXTRA);
+  cm  = &heap_glob->cpus_heap[cpu_id()].mags_cpu[tub - heap_glob->tubs];
+
+  addr = mag_alloc(tub, cm);
+  if (!addr) {
+    addr = tub_alloc(tub);
+    if (!addr)
+      return NULL;
+  }
+#ifdef HEAP_HARDEN
+  else
+    chunk_check_poison(tub, addr);
+#endif
+
+  heap_prof_charge(addr, caller);
+  tub->allocs_tub++;
+
+#ifdef HEAP_HARDEN
+  addr = chunk_guard(tub, addr, sz);
+#endif
+
+  /* Nobody looks past sz, so that is all we zero */
+  if (flags & HEAP_ZERO)
+    memset((ub1 *)addr, sz, 0);
+
+  return addr;
+}
+
+/* --------------------------------------------------------------------------
+                         Export functions
+   -------------------------------------------------------------------------- */
+
+/*
+ * EF: kmalloc_heap_flags - allocate heap memory
+ *
+ * ARGS :-
+ *   sz    - required size
+ *   flags - HEAP_ZERO to get zeroed memory, HEAP_NOZERO if the caller
+ *           initializes all of it anyway
+ *
+ * RET
+ *   address of allocated memory
+ */
+ub4 *kmalloc_heap_flags(ub4 sz, ub4 flags)
+{
+  return heap_alloc(sz, flags, (ub4)__builtin_return_address(0));
+}
+
+/*
+ * EF: kmalloc_heap - allocate zeroed heap memory
+ *
+ * ARGS :-
+ *   sz - required size
+ *
+ * RET
+ *   address of allocated memory
+ */
+ub4 *kmalloc_heap(ub4 sz)
+{
+  return heap_alloc(sz, HEAP_ZERO, (ub4)__builtin_return_address(0));
+}
+
+/*
+ * EF: kfree_heap - free heap memory
+ *
+ * ARGS :-
+ *   addr - address of allocated memory
+ *
+ * RET
+ */
+void
+kfree_heap(ub4 *addr)
+{
+  tub_t      *tub;
+  bundle_t   *bundle;
+  cpu_mags_t *cm;
+  frame_t    *frame = addr_to_frame(VIRT_TO_PHYS(addr));
+
+  /* Chunks can be page aligned too, so check the frame flag as well */
+  if (!((ub4)addr & (PAGE_SIZE - 1)) &&
+      (frame->flags_frame & FRAME_HEAP_LARGE)) {
+    kfree_large(addr, frame);
+    return;
+  }
+
+  bundle = addr_to_bundle(addr);
+  ASSERT((bundle->magic_bundle == MAGIC_BUNDLE));
+
+  tub = bundle->tub_bundle;
+
+#ifdef HEAP_HARDEN
+  addr = chunk_unguard(tub, addr);
+#endif
+
+  heap_prof_uncharge(addr);
+  tub->frees_tub++;
+
+#ifdef HEAP_HARDEN
+  chunk_poison(tub, addr);
+  addr = heap_quarantine(tub, addr);
+  if (!addr)
+    return;
+
+  tub = addr_to_bundle(addr)->tub_bundle;
+#endif
+
+  cm = &heap_glob->cpus_heap[cpu_id()].mags_cpu[tub - heap_glob->tubs];
+  if (!mag_free(tub, cm, addr))
+    tub_free(addr);
+}
+
+/*
+ * EF: heap_mag_reap - empty the magazine layer
+ *
+ * ARGS :-
+ *
+ * Drains the quarantine, this CPU's magazines and every depot back into the
+ * tubs and frees the magazines. Other CPUs would have to reap their own
+ *
+ * RET
+ */
+void
+heap_mag_reap(void)
+{
+  tub_t      *tub;
+  cpu_mags_t *cm;
+  magazine_t *mag;
+  ub4         idx;
+
+#ifdef HEAP_HARDEN
+  ub4        *addr;
+
+  while ((addr = heap_quarantine(NULL, NULL)))
+    tub_free(addr);
+#endif
+
+  for (idx = 0; idx < N_TUBS; idx++) {
+    tub = &heap_glob->tubs[idx];
+    cm  = &heap_glob->cpus_heap[cpu_id()].mags_cpu[idx];
+
+    if ((mag = cm->loaded_mag)) {
+      cm->loaded_mag = NULL;
+      mag_drain(tub, mag);
+      mag_delete(mag);
+    }
+
+    if ((mag = cm->prev_mag)) {
+      cm->prev_mag = NULL;
+      mag_drain(tub, mag);
+      mag_delete(mag);
+    }
+
+    while (tub->full_mags_count_tub) {
+      mag = list_entry(list_remove_front(&tub->full_mags_tub), magazine_t,
+                       link_mag);
+      tub->full_mags_count_tub--;
+      mag_drain(tub, mag);
+      mag_delete(mag);
+    }
+
+    while (tub->empty_mags_count_tub) {
+      mag = list_entry(list_remove_front(&tub->empty_mags_tub), magazine_t,
+                       link_mag);
+      tub->empty_mags_count_tub--;
+      mag_delete(mag);
+    }
+  }
+}
+
+/*
+ * EF: heap_prof_dump - print the heaviest heap users
+ *
+ * ARGS :-
+ *   top - # call sites to print (at most HEAP_PROF_TOP)
+ *
+ * Sites are ranked by the chunk bytes they still hold. The caller is a
+ * return address, look it up in kernel.elf (addr2line)
+ *
+ * RET
+ */
+void
+heap_prof_dump(ub4 top)
+{
+  bool         shown[HEAP_PROF_SITES];
+  heap_site_t *site;
+  ub4          best;
+  ub4          idx;
+  ub4          rank;
+
+  memset((ub1 *)shown, sizeof(shown), 0);
+  if (top > HEAP_PROF_TOP)
+    top = HEAP_PROF_TOP;
+
+  printk_shell("caller      size  live bytes  live  allocs\n");
+  for (rank = 0; rank < top; rank++) {
+    best = HEAP_PROF_SITES;
+    for (idx = 0; idx < HEAP_PROF_SITES; idx++) {
+      site = &heap_glob->sites_heap[idx];
+      if (shown[idx] || !site->allocs_site)
+        continue;
+
+      if (best == HEAP_PROF_SITES ||
+          site->live_bytes_site > heap_glob->sites_heap[best].live_bytes_site)
+        best = idx;
+    }
+
+    if (best == HEAP_PROF_SITES)
+      break;
+
+    shown[best] = true;
+    site        = &heap_glob->sites_heap[best];
+    /* Slot 0 lumps together every site that did not get a slot */
+    if (best) {
+      printk_shell_hex(site->caller_site);
+      printk_shell("  ");
+      printk_shell_num(heap_glob->tubs[site->tub_site].size_tub);
+    } else
+      printk_shell("(other)     *");
+    printk_shell("  ");
+    printk_shell_num(site->live_bytes_site);
+    printk_shell("  ");
+    printk_shell_num(site->live_count_site);
+    printk_shell("  ");
+    printk_shell_num(site->allocs_site);
+    printk_shell("\n");
+  }
+
+  printk_shell_num(heap_glob->sites_count_heap);
+  printk_shell(" call sites tracked\n");
+}
+
+/*
  * EF: heap_init_func - module init function
- * 
+ *
  * ARGS :-
  *
  * RET - TRUE iff successful
@@ -321,39 +1187,47 @@ bool
 heap_init_func(void)
 {
   ub4 idx = 0;
+  ub4 tub_idx;
   ub4 sz  = sizeof(*heap_glob);
 
-  bundle_size = (tub_sizes[N_TUBS - 1] + sizeof(chunk_t));
-
+  /* kmalloc hands out zeroed memory */
   heap_glob = (heap_t *)kmalloc(sz);
-  memset((ub1 *)heap_glob, sz, 0);
 
   /* No point handling mem alloc failures, in any */
   ASSERT(heap_glob);
-  list_init(&heap_glob->free_bundles_heap);
-  heap_glob->free_bundles_count = 0;
-
-  list_init(&heap_glob->in_use_bundles_heap);
-  heap_glob->in_use_bundles_count = 0;
 
-  heap_glob->total_bundles = 0;
+  /* Let the heap grow to at most half of physical memory */
+  heap_glob->max_bundles = (get_total_frames() / 2) / (1 << BUNDLE_ORDER);
+  if (heap_glob->max_bundles < MIN_BUNDLES)
+    heap_glob->max_bundles = MIN_BUNDLES;
 
   for (idx = 0; idx < N_TUBS; idx++)
     init_tub(&heap_glob->tubs[idx], tub_sizes[idx]);
- 
-  if (!add_bundles(INIT_BUNDLES))
-    return false;
+
+  /* Smallest tub holding every size in each 8 byte slot */
+  for (idx = 0, tub_idx = 0; idx <= (HEAP_MAX_CHUNK >> HEAP_CLASS_SHIFT);
+       idx++) {
+    while (tub_sizes[tub_idx] < (idx << HEAP_CLASS_SHIFT))
+      tub_idx++;
+    heap_glob->tub_index[idx] = tub_idx;
+  }
+
+  /* Goes after the shrinkers that free chunks */
+  heap_shrinker.name_shrinker = "heap";
+  heap_shrinker.func_shrinker = heap_shrink;
+  heap_shrinker.prio_shrinker = SHRINK_PRIO_CACHE;
+  register_shrinker(&heap_shrinker);
 
   printk_system("Initialized heap..");
   return true;
 }
 
-/* 
+/*
  * EF: heap_exit_func - module exit function
- * 
+ *
  * ARGS :-
  *
- * RET 
+ * RET
  */
 void
 heap_exit_func(void)
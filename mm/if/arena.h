@@ -0,0 +1,65 @@
+/* KalioOS (C) 2020 Pranav Bagur */
+
+/*
+ * Arenas (bump allocators)
+ *
+ * An arena hands out memory for objects that all die together, like the
+ * tokens of a shell command. Memory comes out of page sized blocks by
+ * bumping a pointer, there is no per object header and no per object free.
+ * arena_reset releases everything at once by rewinding to the first block:
+ *
+ *   blocks_arena
+ *   +-------+-------+-------+----   +-------+-------+-------------+
+ *   | block | obj 0 | obj 1 | ... > | block | obj n |    free     |
+ *   +-------+-------+-------+----   +-------+-------+-------------+
+ *                                                   ^ cur_arena
+ *
+ * Blocks are kept across resets, so an arena that is reused for every
+ * request stops allocating once it has grown to the largest request.
+ * arena_destroy gives them back to the frame allocator.
+ */
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include "../../common/if/types.h"
+#include "../../common/if/list.h"
+#include "memory.h"
+
+/* --------------------------------------------------------------------------
+                         Constants and types
+   -------------------------------------------------------------------------- */
+#define ARENA_ALIGN      8
+#define ARENA_MAX_ALLOC  (PAGE_SIZE - sizeof(arena_block_t))
+
+/* STRUCT arena_block_t - Header of a block (a frame) of an arena */
+typedef struct _arena_block
+{
+  list      link_block;
+} arena_block_t;
+
+/* STRUCT arena_t - Describes an arena */
+typedef struct _arena
+{
+  list           blocks_arena;
+  ub4            blocks_count_arena;
+  arena_block_t *block_arena;       /* block we are allocating from   */
+  ub1           *cur_arena;         /* next free byte in block_arena  */
+  ub1           *end_arena;
+} arena_t;
+
+/* --------------------------------------------------------------------------
+                         Export function declarations
+   -------------------------------------------------------------------------- */
+/* initialize an empty arena */
+void arena_init(arena_t *arena);
+
+/* allocate from an arena (not zeroed), at most ARENA_MAX_ALLOC bytes */
+void *arena_alloc(arena_t *arena, ub4 size);
+
+/* free everything allocated from an arena */
+void arena_reset(arena_t *arena);
+
+/* free everything and give the blocks back */
+void arena_destroy(arena_t *arena);
+
+#endif
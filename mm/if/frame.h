@@ -0,0 +1,177 @@
+/* KalioOS (C) 2020 Pranav Bagur */
+
+/*
+ * Physical frame allocator
+ *
+ * Physical memory is handed out in blocks of 2^order contiguous frames using
+ * a buddy system. Every order keeps its own free list, so allocation is a
+ * list pop plus at most FRAME_MAX_ORDER splits. Freed blocks are merged with
+ * their buddy (the block whose index differs only in bit 'order') for as long
+ * as the buddy is free and of the same order.
+ *
+ * Every frame has a descriptor (frame_t) and a bit in the frame bitmap. The
+ * descriptor holds the free list link and the order of the block it heads.
+ * The bitmap holds the allocated state of every single frame, so checking or
+ * counting frames never has to walk the free lists.
+ *
+ * Blocks are naturally aligned: a block of order n always starts on a
+ * (PAGE_SIZE << n) boundary.
+ *
+ * Frames are handed out by physical address. Callers that want to touch the
+ * memory go through the direct map (PHYS_TO_VIRT).
+ *
+ * A small pool of frames is zeroed ahead of time (when the kernel has nothing
+ * better to do) for callers that need a zeroed frame. Pool frames count as
+ * allocated and are handed back to the buddy allocator before it runs dry.
+ *
+ * After the zero pool, subsystems that sit on memory they could do without
+ * (cached bundles, empty slabs, idle buffers...) get a chance to give it
+ * back: they register a shrinker, and alloc_frames runs the shrinkers, in
+ * priority order, until the request can be met. Only then does it fail.
+ */
+#ifndef __FRAME_H
+#define __FRAME_H
+
+#include "../../common/if/types.h"
+#include "../../common/if/list.h"
+#include "memory.h"
+
+/* --------------------------------------------------------------------------
+                         Constants and types
+   -------------------------------------------------------------------------- */
+#define FRAME_SHIFT      12
+#define FRAME_MAX_ORDER  10      /* 2^10 frames = 4 MB */
+#define FRAME_ZERO_POOL  32      /* pre-zeroed frames kept for zero allocs */
+
+/* frame_t flags */
+#define FRAME_FREE       0x1     /* frame heads a free block               */
+#define FRAME_RESERVED   0x2     /* frame is not managed (BIOS, kernel...) */
+#define FRAME_HEAP_LARGE 0x4     /* frame heads a large heap allocation    */
+
+/* shrinker priorities, lower runs first */
+#define SHRINK_PRIO_USER  0      /* frees objects back to an allocator     */
+#define SHRINK_PRIO_CACHE 1      /* frees cached memory back to frames     */
+
+/* release what memory you can do without */
+typedef void (*shrink_func_t)(void);
+
+/* STRUCT shrinker_t - A reclaim callback run under memory pressure */
+typedef struct _shrinker
+{
+  list          link_shrinker;
+  ub1          *name_shrinker;
+  shrink_func_t func_shrinker;
+  ub4           prio_shrinker;   /* SHRINK_PRIO_*                          */
+  ub4           calls_shrinker;
+  ub4           freed_shrinker;  /* # frames it released, in total         */
+} shrinker_t;
+
+/* STRUCT frame_t - Describes a physical frame */
+typedef struct _frame
+{
+  list      link_frame;
+  ub1       order_frame;
+  ub1       flags_frame;
+  ub2       run_frame;           /* # frames in a run (FRAME_HEAP_LARGE)   */
+} frame_t;
+
+/* STRUCT frame_area_t - Describes all the physical frames we manage */
+typedef struct _frame_area
+{
+  list      free_list_area[FRAME_MAX_ORDER + 1];
+  ub4       free_count_area[FRAME_MAX_ORDER + 1];
+
+  frame_t  *frames_area;
+  ub4      *bitmap_area;
+  ub4       nframes_area;
+
+  ub4       free_frames_area;
+  ub4       total_frames_area;
+
+  list      zero_list_area;      /* allocated frames known to be zero     */
+  ub4       zero_count_area;
+
+  list      shrinkers_area;      /* sorted by priority                    */
+  bool      shrinking_area;      /* shrinkers must not recurse            */
+  ub4       shrink_runs_area;
+} frame_area_t;
+
+/* --------------------------------------------------------------------------
+                         Macros
+   -------------------------------------------------------------------------- */
+#define ADDR_TO_PFN(_addr)  ((ub4)(_addr) >> FRAME_SHIFT)
+#define PFN_TO_ADDR(_pfn)   ((ub4)(_pfn) << FRAME_SHIFT)
+
+/* --------------------------------------------------------------------------
+                         Export function declarations
+   -------------------------------------------------------------------------- */
+/* smallest order whose block can hold 'size' bytes */
+ub4 size_to_order(ub4 size);
+
+/* allocate 2^order contiguous frames, returns phys addr (0 on failure) */
+ub4 alloc_frames(ub4 order);
+
+/* free a block returned by alloc_frames */
+void free_frames(ub4 addr);
+
+/* allocate 'count' contiguous frames without rounding up to a power of 2 */
+ub4 alloc_frames_exact(ub4 count);
+
+/* free a run returned by alloc_frames_exact */
+void free_frames_exact(ub4 addr, ub4 count);
+
+/* allocate a single frame */
+ub4 alloc_frame(void);
+
+/* free a single frame */
+void free_frame(ub4 addr);
+
+/* allocate a single zeroed frame, from the zero pool when possible */
+ub4 alloc_zeroed_frame(void);
+
+/* zero one frame into the zero pool, returns false if the pool is full */
+bool fill_zero_pool(void);
+
+/* give the zero pool back to the buddy allocator, returns # frames */
+ub4 drain_zero_pool(void);
+
+/* register a shrinker, alloc_frames runs it before failing */
+void register_shrinker(shrinker_t *shrinker);
+
+/* remove a registered shrinker */
+void unregister_shrinker(shrinker_t *shrinker);
+
+/* run shrinkers until a block of 2^order frames is free, returns # freed */
+ub4 shrink_frames(ub4 order);
+
+/* number of times the shrinkers were run */
+ub4 get_shrink_runs(void);
+
+/* is the frame holding addr allocated? */
+bool frame_in_use(ub4 addr);
+
+/* descriptor of the frame holding addr */
+frame_t *addr_to_frame(ub4 addr);
+
+/* number of free frames */
+ub4 get_free_frames(void);
+
+/* number of managed frames */
+ub4 get_total_frames(void);
+
+/* number of free blocks of an order */
+ub4 get_free_blocks(ub4 order);
+
+/* number of frames in the zero pool */
+ub4 get_zero_pool_frames(void);
+
+/* highest physical address we manage (exclusive) */
+ub4 get_mem_end(void);
+
+/* module init function   */
+bool frame_init_func(void);
+
+/* module exit function   */
+void frame_exit_func(void);
+
+#endif
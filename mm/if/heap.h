@@ -1,91 +1,252 @@
 /* KalioOS (C) 2020 Pranav Bagur */
 
+/*
+ * The heap is a set of tubs, one per chunk size. Sizes go up in 8 byte steps
+ * to 64 and 16 byte steps to 128. Above that every power of 2 is split into 8
+ * classes about 12.5% apart. The tub for a size is found with a lookup table
+ * indexed by the size in 8 byte units.
+ *
+ * A tub carves its chunks out of bundles: naturally aligned blocks of
+ * BUNDLE_SIZE bytes that start with their own descriptor and an in-use bitmap
+ * (one bit per chunk).
+ *
+ * +----------+-------------------+---------+---------+---------+-----+
+ * | bundle_t | map_bundle[words] | chunk 0 | chunk 1 | chunk 2 | ... |
+ * +----------+-------------------+---------+---------+---------+-----+
+ *
+ * Chunks have no header. The bundle owning a chunk is found by masking the
+ * chunk address with BUNDLE_SIZE, and the chunk index by dividing the offset
+ * by the tub size.
+ *
+ * A bundle whose last chunk is freed is not released right away. It moves to
+ * the empty list of its tub, and only once that list grows past the high
+ * watermark is it trimmed back down to the low watermark. Churning a single
+ * chunk therefore never touches the frame allocator. Chunks are zeroed when
+ * they are handed out (and only if the caller asks for HEAP_ZERO), never when
+ * a bundle is freed or cached.
+ *
+ * Anything bigger than the largest tub is a large allocation: a run of whole
+ * frames whose length is kept in the descriptor of its first frame.
+ *
+ * Chunk allocations are profiled by call site. Every (caller, tub) pair gets
+ * a slot in a small open addressed table, and every chunk remembers its slot
+ * in a byte of its bundle, right after the in-use bitmap, so a free can be
+ * charged back to whoever allocated it. That is a hash and a few adds per
+ * call, cheap enough to always be on. Once the table is full, new call sites
+ * are lumped together in slot 0.
+ *
+ * +----------+-------------------+---------------+---------+-----+
+ * | bundle_t | map_bundle[words] | sites[chunks] | chunk 0 | ... |
+ * +----------+-------------------+---------------+---------+-----+
+ *
+ * In front of the tubs sit magazines (Bonwick): small LIFO stacks of free
+ * chunks. Every CPU has a loaded and a previous magazine per tub, and a free
+ * or alloc that the two can absorb touches nothing but that CPU's own slot.
+ * Only when both are full (free) or empty (alloc) does the CPU go to the
+ * tub's depot and trade a whole magazine for a full or an empty one, so the
+ * shared tub state is touched once per magazine, not once per chunk.
+ * Chunks in magazines still count as in use by their tub (cached_tub).
+ *
+ * Built with HEAP_HARDEN (make HARDEN=1) every chunk carries its requested
+ * size and a canary in front and a redzone of at least HEAP_RZ_TAIL bytes
+ * behind, all checked when it is freed:
+ *
+ * +----+--------+----------------------------+-----------------+
+ * | sz | canary | sz bytes for the caller    | redzone         |
+ * +----+--------+----------------------------+-----------------+
+ *
+ * Free chunks are filled with HEAP_POISON_BYTE, and the poison is checked
+ * before a chunk is handed out again. Freed chunks also sit in a FIFO of
+ * HEAP_QUARANTINE chunks (counted in cached_tub) before they can be reused,
+ * which gives a stray write through a stale pointer time to hit the poison.
+ * Large allocations are not hardened.
+ */
 #ifndef __HEAP_H
 #define __HEAP_H
 
 #include "../../common/if/types.h"
 #include "../../common/if/common.h"
 #include "../../common/if/list.h"
+#include "../../common/if/cpu.h"
 #include "paging.h"
 #include "memory.h"
-/* -------------------------------------------------------------------------- 
+/* --------------------------------------------------------------------------
                          Constants and types
-   -------------------------------------------------------------------------- */ 
-#define N_TUBS             6
-#define MAX_BUNDLES        100
-#define INIT_BUNDLES       20
-#define GROW_BUNDLES_LIMIT 10
-#define MAGIC_CHUNK        0x71291
-/* 
+   -------------------------------------------------------------------------- */
+#define N_TUBS             44
+#define HEAP_MAX_CHUNK     2048 /* bigger requests are large allocations  */
+#define HEAP_CLASS_SHIFT   3    /* tub lookup granularity (8 bytes)       */
+#define MIN_BUNDLES        100  /* the bundle limit scales with memory */
+#define MAGIC_BUNDLE       0x71291
+#define BUNDLE_ORDER       1
+#define BUNDLE_SIZE        (PAGE_SIZE << BUNDLE_ORDER)
+#define HEAP_ALIGN         8
+/* kmalloc_heap_flags flags */
+#define HEAP_NOZERO        0x0  /* caller initializes the memory itself   */
+#define HEAP_ZERO          0x1  /* memory is zeroed                       */
+
+#define HEAP_EMPTY_LOW_WM  1    /* empty bundles kept after a trim        */
+#define HEAP_EMPTY_HIGH_WM 2    /* trim once a tub caches more than these */
+
+#define HEAP_MAG_ROUNDS    15   /* most chunks a magazine can hold        */
+#define HEAP_MAG_MIN       2    /* least, for the biggest tubs            */
+#define HEAP_MAG_BYTES     4096 /* a magazine caches at most about this   */
+#define HEAP_DEPOT_FULL    2    /* full magazines a depot keeps           */
+#define HEAP_DEPOT_EMPTY   2    /* empty magazines a depot keeps          */
+
+#define HEAP_RZ_BYTE       0xCB /* redzone and canary filler              */
+#define HEAP_POISON_BYTE   0x6B /* free chunk filler                      */
+#define HEAP_RZ_HEAD       8    /* size word + canary                     */
+#define HEAP_RZ_TAIL       8    /* least redzone behind a chunk           */
+#define HEAP_QUARANTINE    64   /* freed chunks held back from reuse      */
+#ifdef HEAP_HARDEN
+#define HEAP_RZ_EXTRA      (HEAP_RZ_HEAD + HEAP_RZ_TAIL)
+#else
+#define HEAP_RZ_EXTRA      0
+#endif
+
+#define HEAP_PROF_SITES    256  /* call site slots, ids fit in a ub1      */
+#define HEAP_PROF_PROBES   8    /* give up (slot 0) after this many       */
+#define HEAP_PROF_TOP      8    /* # sites heap_prof_dump prints          */
+
+struct _tub;
+
+/* STRUCT magazine_t - A stack of free chunks of one tub */
+typedef struct _magazine
+{
+  list      link_mag;              /* on a depot list of the tub        */
+  ub4       rounds_mag;            /* # chunks held                     */
+  void     *objs_mag[HEAP_MAG_ROUNDS];
+} magazine_t;
+
+/* STRUCT cpu_mags_t - The magazines a CPU holds for one tub */
+typedef struct _cpu_mags
+{
+  magazine_t *loaded_mag;          /* chunks come and go here           */
+  magazine_t *prev_mag;            /* always empty or full              */
+} cpu_mags_t;
+
+/* STRUCT heap_cpu_t - Per CPU heap state, a cache line apart */
+typedef struct _heap_cpu
+{
+  cpu_mags_t mags_cpu[N_TUBS];
+} __attribute__((aligned(64))) heap_cpu_t;
+
+/*
  * STRUCT bundle_t - Describes a bundle (divided into chunks depending on
- * the tub) 
+ * the tub). Lives at the start of the bundle
  */
 typedef struct _bundle
 {
-  list      link_heap_bundle;
-  list      link_tub_bundle;
-  list      chunks_bundle;
-  ub4       chunks_count_bundle;
-
-  ub4       chunks_in_use_bundle;
-  ub4      *mem_bundle;
+  list          link_tub_bundle;   /* on the avl or empty list of a tub */
+  ub4           magic_bundle;
+  struct _tub  *tub_bundle;
+
+  ub2           chunks_count_bundle;
+  ub2           chunks_in_use_bundle;
+  ub2           hint_bundle;       /* lowest map word with a free bit   */
+  ub2           rsvd_bundle;
+  ub4           map_bundle[];      /* 1 bit per chunk, set if in use,   */
+                                   /* then 1 site slot byte per chunk   */
 } bundle_t;
 
 /* STRUCT tub_t - Describes a tub */
 typedef struct _tub
 {
-  list      bundles_tub;
+  list      avl_bundles_tub;       /* partially used bundles             */
+  ub4       avl_bundles_count_tub;
+
+  list      empty_bundles_tub;     /* cached bundles with no chunk in use */
+  ub4       empty_count_tub;
+  ub4       low_wm_tub;
+  ub4       high_wm_tub;
   ub4       bundles_count_tub;
 
-  list      avl_chunks_tub;
   ub4       avl_chunks_count_tub;
-
   ub4       total_in_use_tub;
   ub4       total_tub;
 
   ub4       size_tub;
+  ub4       chunks_per_bundle_tub;
+  ub4       map_words_tub;
+  ub4       offset_tub;            /* offset of chunk 0 in a bundle      */
+
+  ub4       allocs_tub;            /* cumulative, see meminfo            */
+  ub4       frees_tub;
+  ub4       grows_tub;             /* # bundles taken from frames        */
+  ub4       shrinks_tub;           /* # bundles given back               */
+
+  list      full_mags_tub;         /* depot                              */
+  ub4       full_mags_count_tub;
+  list      empty_mags_tub;
+  ub4       empty_mags_count_tub;
+  ub4       mag_rounds_tub;        /* capacity of this tub's magazines   */
+  ub4       cached_tub;            /* # free chunks held back from tub   */
 } tub_t;
 
-/* STRUCT chunk_t - Describes a chunk of memory */
-typedef struct _chunk
+/* STRUCT heap_site_t - Chunks one call site has taken from one tub */
+typedef struct _heap_site
 {
-  list      link_avl_chunk;
-  list      link_bundle_chunk;
-  ub4       magic_chunk;
-  bool      in_use_chunk;
-  tub_t    *bp_tub_chunk;
-  bundle_t *bp_bundle_chunk;
-  ub4       size_chunk;
-} chunk_t;
+  ub4       caller_site;           /* return address, 0 if the slot is free */
+  ub1       tub_site;              /* index of the tub                      */
+  ub1       rsvd_site[3];
+  ub4       live_bytes_site;       /* chunk bytes still allocated           */
+  ub4       live_count_site;
+  ub4       allocs_site;           /* # allocations ever                    */
+} heap_site_t;
 
 /* STRUCT heap_t - Describes the heap (holds multiple tubs) */
 typedef struct _heap {
-  list      free_bundles_heap;
-  ub4       free_bundles_count;
-
-  list      in_use_bundles_heap;
-  ub4       in_use_bundles_count;
-
   ub4       total_bundles;
+  ub4       max_bundles;
+
+  ub4       large_allocs_heap;
+  ub4       large_frames_heap;
   tub_t     tubs[N_TUBS];
+  ub1       tub_index[(HEAP_MAX_CHUNK >> HEAP_CLASS_SHIFT) + 1];
+
+  ub4         sites_count_heap;    /* # slots in use, slot 0 excluded       */
+  heap_site_t sites_heap[HEAP_PROF_SITES];
+
+  ub4         mags_heap;           /* # magazines allocated                 */
+  heap_cpu_t  cpus_heap[NR_CPUS];
+
+#ifdef HEAP_HARDEN
+  ub4        *quarantine_heap[HEAP_QUARANTINE];
+  ub4         quarantine_head_heap;  /* oldest chunk                        */
+  ub4         quarantine_count_heap;
+#endif
 } heap_t;
 
-/* -------------------------------------------------------------------------- 
+extern heap_t *heap_glob;
+
+/* --------------------------------------------------------------------------
                          Macros
-   -------------------------------------------------------------------------- */ 
+   -------------------------------------------------------------------------- */
+#define addr_to_bundle(_addr)                                                 \
+  ((bundle_t *)((ub4)(_addr) & ~(BUNDLE_SIZE - 1)))
 
-/* -------------------------------------------------------------------------- 
+/* --------------------------------------------------------------------------
                          Export function declarations
-   -------------------------------------------------------------------------- */ 
-/* reserve mem on the heap */
+   -------------------------------------------------------------------------- */
+/* reserve zeroed mem on the heap */
 ub4 *kmalloc_heap(ub4 size);
 
+/* reserve mem on the heap, see HEAP_ZERO/HEAP_NOZERO */
+ub4 *kmalloc_heap_flags(ub4 size, ub4 flags);
+
 /* free reserved mem on the heap */
 void kfree_heap(ub4 *addr);
 
-/* module init function   */ 
+/* print the call sites holding the most heap memory */
+void heap_prof_dump(ub4 top);
+
+/* give every chunk cached in magazines back to its tub */
+void heap_mag_reap(void);
+
+/* module init function   */
 bool heap_init_func(void);
 
-/* module exit function   */ 
+/* module exit function   */
 void heap_exit_func(void);
 #endif
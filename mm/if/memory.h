@@ -1,11 +1,10 @@
 /* KalioOS (C) 2020 Pranav Bagur */
 
 /* 
- * The routines defined here can be used by the rest of the kernel to reserve
- * memory. The assumption we make here is that once reserved, memory cannot
- * be freed. Thus, we run out of memory once we reach the end and panic.
- *
- * The heap will reserve a chunk of memory using these routines and manage it
+ * The routines defined here are the boot allocator. They reserve memory
+ * before the frame allocator (see frame.h) is up. Memory reserved here can
+ * never be freed. Once the frame allocator takes over the rest of memory,
+ * the boot allocator is sealed and any further use of it panics.
  */
 #ifndef __MEMORY_H
 #define __MEMORY_H
@@ -20,27 +19,101 @@
  * from the linker
  */
 #define FREE_MEM_START 0x100000
-#define MEM_SIZE       0x1000000 /* 16 MB */
+#define MEM_SIZE       0x1000000  /* 16 MB, used if the BIOS has no E820 */
+#define MEM_MAX        0x38000000 /* 896 MB, memory above this is ignored  */
+
+/* 
+ * The kernel runs in the top GB of the address space. Physical memory up to
+ * MEM_MAX is mapped linearly from KERNEL_VIRT_BASE on (the direct map, see
+ * paging_init_func), which leaves everything below it to user space.
+ * kernel/kernel_entry.asm maps only the first BOOT_MAP_END bytes, so that is
+ * all the boot allocator can hand out
+ */
+#define KERNEL_VIRT_BASE 0xC0000000
+#define BOOT_MAP_END     0x1000000  /* 16 MB */
 
 #define PAGE_SIZE      0x1000    /* 4 KB */
 
+/* E820 entry types */
+#define E820_USABLE      1
+#define E820_MAX_ENTRIES 32
+#define MAX_MEM_REGIONS  E820_MAX_ENTRIES
+
+#define MEM_REP_MIN      64      /* shorter memset/memcpy go a word at a time */
+#define MEM_SSE_MIN      256     /* shorter ones do not use SSE2              */
+
+/* STRUCT e820_entry_t - Describes an entry of the BIOS memory map */
+typedef struct __attribute__((packed)) _e820_entry
+{
+  ub8       base_e820;
+  ub8       len_e820;
+  ub4       type_e820;
+  ub4       acpi_e820;
+} e820_entry_t;
+
+/* STRUCT e820_map_t - BIOS memory map, filled in by boot/detect_memory.asm */
+typedef struct __attribute__((packed)) _e820_map
+{
+  ub4          count_e820;
+  ub4          rsvd_e820;
+  e820_entry_t entries_e820[E820_MAX_ENTRIES];
+} e820_map_t;
+
+/* STRUCT mem_region_t - Describes a usable range of physical memory */
+typedef struct _mem_region
+{
+  ub4       start_region;  /* page aligned */
+  ub4       end_region;    /* page aligned, exclusive */
+} mem_region_t;
+
 /* -------------------------------------------------------------------------- 
                          Macros
    -------------------------------------------------------------------------- */ 
+/* Direct map address of a physical address (and back) */
+#define PHYS_TO_VIRT(_addr)  ((ub4)(_addr) + KERNEL_VIRT_BASE)
+#define VIRT_TO_PHYS(_addr)  ((ub4)(_addr) - KERNEL_VIRT_BASE)
+
 /* -------------------------------------------------------------------------- 
                          Export function declarations
    -------------------------------------------------------------------------- */ 
 
+/* Build the usable region list from the BIOS memory map */
+void init_mem_map(e820_map_t *map);
+
+/* Number of usable memory regions */
+ub4 get_mem_region_count(void);
+
+/* Usable memory region idx (sorted by address) */
+mem_region_t *get_mem_region(ub4 idx);
+
 /* Return free mem ptr  */
 ub4 get_free_mem_ptr(void);
 
-/* Reserve memory chunk  */
+/* Reserve memory chunk, returns its direct map address */
 ub4 kmalloc_mem(ub4 size, bool align);
 
+/* Stop the boot allocator, returns the page aligned end of boot memory */
+ub4 seal_boot_mem(void);
+
+/* Has the boot allocator been sealed? */
+bool is_boot_mem_sealed(void);
+
 /* Set all the bytes in a mem range to val */
 void memset(ub1 *addr, ub4 len, ub1 val);
 
 /* copy 'len' bytes from source to dest */
 void memcpy(ub1 *src, ub1 *dest, ub4 len);
 
+/* copy 'len' bytes from source to dest, the ranges may overlap */
+void memmove(ub1 *src, ub1 *dest, ub4 len);
+
+/* compare 'len' bytes */
+sb4 memcmp(ub1 *mem1, ub1 *mem2, ub4 len);
+
+/* module init function (picks the memset/memcpy implementation) */
+bool memory_init_func(void);
+
+/* module exit function   */
+void memory_exit_func(void);
+
 #endif
@@ -34,14 +34,35 @@
 #define RW_OFFSET       1
 #define USERMODE_OFFSET 2
 
+/* 
+ * A page directory entry with PDE_LARGE set maps a whole 4 MB page (PSE)
+ * directly, without a page table
+ */
+#define PDE_LARGE       0x80
+#define LARGE_PAGE_SIZE 0x400000
+
+/* 
+ * With PGE, a global entry survives CR3 reloads. Only the direct map is
+ * global, it is the same in every address space and is never unmapped
+ */
+#define PTE_GLOBAL      0x100
+
+/* Unmapping more pages than this flushes the whole TLB once, not per page */
+#define INVLPG_MAX      32
+#define UNMAP_GATHER    64      /* frames held back for one full flush    */
+
+/* remove_page_range flags */
+#define UNMAP_FREE      0x1     /* free the frames that were mapped       */
+#define UNMAP_NOFLUSH   0x2     /* caller flushes the TLB (flush_tlb_all) */
+
 #define PAGE_DIR_OFFSET (22ULL)
 #define PAGE_DIR_LEN    (1024ULL)
-#define PAGE_DIR_MASK   ((1ULL << PAGE_DIR_LEN) - 1ULL)
+#define PAGE_DIR_MASK   (PAGE_DIR_LEN - 1ULL)
 
 
 #define PAGE_TABLE_OFFSET (12ULL)
 #define PAGE_TABLE_LEN    (1024ULL)
-#define PAGE_TABLE_MASK   ((1ULL << PAGE_TABLE_LEN) - 1ULL)
+#define PAGE_TABLE_MASK   (PAGE_TABLE_LEN - 1ULL)
 
 typedef ub4 page_entry_t;
 
@@ -56,6 +77,7 @@ typedef struct _page_dir
 {
   page_table_t *page_tables[1024];
   ub4 tablesPhysical[1024];
+  ub2 tablesUsed[1024];       /* # present entries, the table goes at 0 */
 } page_dir_t;
 
 extern page_dir_t *cur_dir;
@@ -76,9 +98,24 @@ void switch_page_dir(page_dir_t *dir);
 /* add page table entry */
 void add_page_table_entry(ub4 virt_addr, ub4 phys_addr, page_dir_t *dir);
 
-/* reserve frame and add a page table entry */
+/* remove page table entry, returns the phys addr it mapped (0 if none) */
+ub4 remove_page_table_entry(ub4 virt_addr, page_dir_t *dir);
+
+/* remove npages entries from virt_addr on (UNMAP_* flags) */
+ub4 remove_page_range(ub4 virt_addr, ub4 npages, page_dir_t *dir, ub4 flags);
+
+/* flush the whole TLB */
+void flush_tlb_all(void);
+
+/* number of frames holding page tables */
+ub4 get_page_table_frames(void);
+
+/* reserve page granular memory */
 ub4 kmalloc(ub4 size);
 
+/* release memory reserved by kmalloc */
+void kfree(ub4 addr);
+
 /* module init function   */ 
 bool paging_init_func(void);
 
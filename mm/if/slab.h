@@ -0,0 +1,106 @@
+/* KalioOS (C) 2020 Pranav Bagur */
+
+/*
+ * Object caches (see Bonwick, "The Slab Allocator: An Object-Caching Kernel
+ * Memory Allocator")
+ *
+ * A cache hands out objects of one size. Its memory comes in slabs: a naturally
+ * aligned block of frames that starts with a slab_t, followed by the free
+ * index chain and then the objects themselves.
+ *
+ * +---------+---------------------+-------+-------+-------+-----+
+ * | slab_t  | next_slab[0 .. n-1] | obj 0 | obj 1 | obj 2 | ... |
+ * +---------+---------------------+-------+-------+-------+-----+
+ *
+ * The free list is a chain of object indices kept in next_slab[], so a free
+ * object is never written to. The constructor runs once per object when its
+ * slab is created. Objects must be returned to the cache in their constructed
+ * state, which lets a hot cache skip initialization (and zeroing) entirely.
+ *
+ * The slab owning an object is found by masking the object address with the
+ * slab size.
+ */
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include "../../common/if/types.h"
+#include "../../common/if/list.h"
+#include "memory.h"
+
+/* --------------------------------------------------------------------------
+                         Constants and types
+   -------------------------------------------------------------------------- */
+#define KMEM_NAME_LEN        16
+#define KMEM_MIN_ALIGN       4
+#define KMEM_MAX_SLAB_ORDER  3
+#define KMEM_MIN_OBJS        8   /* try to fit at least these many per slab */
+#define KMEM_MAX_EMPTY_SLABS 1   /* empty slabs kept around per cache      */
+#define KMEM_SLAB_END        0xFFFF
+
+typedef void (*kmem_ctor_t)(void *);
+
+/* STRUCT kmem_cache_t - Describes an object cache */
+typedef struct _kmem_cache
+{
+  list        link_cache;
+  ub1         name_cache[KMEM_NAME_LEN];
+
+  ub4         size_cache;        /* object size (aligned)                */
+  ub4         align_cache;
+  ub4         order_cache;       /* slab is 2^order frames               */
+  ub4         objs_per_slab_cache;
+  ub4         offset_cache;      /* offset of the first object in a slab */
+  kmem_ctor_t ctor_cache;
+
+  list        partial_slabs_cache;
+  ub4         partial_count_cache;
+
+  list        full_slabs_cache;
+  ub4         full_count_cache;
+
+  list        empty_slabs_cache;
+  ub4         empty_count_cache;
+
+  ub4         total_objs_cache;
+  ub4         in_use_objs_cache;
+} kmem_cache_t;
+
+/* STRUCT slab_t - Describes a slab (lives at the start of the slab) */
+typedef struct _slab
+{
+  list          link_slab;
+  kmem_cache_t *cache_slab;
+  ub2           in_use_slab;
+  ub2           free_slab;       /* first free object, KMEM_SLAB_END if none */
+  ub2           next_slab[];     /* free index chain                         */
+} slab_t;
+
+/* --------------------------------------------------------------------------
+                         Macros
+   -------------------------------------------------------------------------- */
+/* --------------------------------------------------------------------------
+                         Export function declarations
+   -------------------------------------------------------------------------- */
+/* create an object cache */
+kmem_cache_t *kmem_cache_create(ub1 *name, ub4 size, ub4 align,
+                                kmem_ctor_t ctor);
+
+/* allocate an object (constructed, not zeroed) */
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+/* return an object (in its constructed state) to its cache */
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/* release all empty slabs of a cache, returns # frames released */
+ub4 kmem_cache_shrink(kmem_cache_t *cache);
+
+/* destroy a cache (all objects must have been freed) */
+void kmem_cache_destroy(kmem_cache_t *cache);
+
+/* module init function   */
+bool slab_init_func(void);
+
+/* module exit function   */
+void slab_exit_func(void);
+
+#endif
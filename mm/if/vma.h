@@ -0,0 +1,112 @@
+/* KalioOS (C) 2020 Pranav Bagur */
+
+/*
+ * Kernel virtual memory areas
+ *
+ * Physical memory is in the direct map below VMALLOC_START (see
+ * paging_init_func). Everything between VMALLOC_START and VMALLOC_END is
+ * handed out in virtual memory areas (VMAs) that are not backed by
+ * contiguous frames.
+ *
+ * A VMA created with VMA_DEMAND has no frames at all to begin with. The first
+ * touch of one of its pages faults, and page_fault_handler backs the page
+ * with a zeroed frame. A large, sparsely used reservation therefore costs a
+ * vma_t and nothing else until it is used.
+ *
+ *   VMALLOC_START                                              VMALLOC_END
+ *   +--------+-------+--------------+-------+---------------------+
+ *   | vma 0  | guard | vma 1        | guard |        free         |
+ *   +--------+-------+--------------+-------+---------------------+
+ *
+ * Every VMA is followed by an unmapped guard page, so running off its end
+ * faults instead of scribbling over the next one.
+ *
+ * vmalloc on the other hand maps all the pages of its VMA up front, one
+ * frame at a time, so a big buffer never needs physically contiguous
+ * memory. vfree unmaps and frees the frames but does not flush the TLB. The
+ * VMA stays on the list as VMA_LAZY, which keeps its range from being handed
+ * out again, until VMA_LAZY_MAX pages have piled up (or the region is full).
+ * A single TLB flush then retires all of them.
+ */
+#ifndef __VMA_H
+#define __VMA_H
+
+#include "../../common/if/types.h"
+#include "../../common/if/list.h"
+#include "memory.h"
+
+/* --------------------------------------------------------------------------
+                         Constants and types
+   -------------------------------------------------------------------------- */
+#define VMALLOC_START    0xF8800000
+#define VMALLOC_END      0xFFC00000
+
+/* vma_t flags */
+#define VMA_DEMAND       0x1     /* pages are backed on first touch        */
+#define VMA_LAZY         0x2     /* freed, waiting for a TLB flush         */
+
+/* # lazily freed pages that triggers a TLB flush */
+#define VMA_LAZY_MAX     1024
+
+/* STRUCT vma_t - Describes a virtual memory area */
+typedef struct _vma
+{
+  list      link_vma;            /* on vmas_area, sorted by address        */
+  ub4       start_vma;
+  ub4       end_vma;             /* exclusive, the guard page is not in it */
+  ub4       flags_vma;
+  ub4       pages_vma;           /* # pages backed by a frame              */
+} vma_t;
+
+/* STRUCT vma_area_t - Describes the VMALLOC region */
+typedef struct _vma_area
+{
+  list      vmas_area;
+  ub4       count_area;
+  ub4       pages_area;          /* # pages backed in all VMAs             */
+  ub4       faults_area;         /* # demand faults served                 */
+  ub4       lazy_area;           /* # pages in VMA_LAZY VMAs               */
+} vma_area_t;
+
+extern vma_area_t *vma_glob;
+
+/* --------------------------------------------------------------------------
+                         Macros
+   -------------------------------------------------------------------------- */
+#define IS_VMALLOC_ADDR(_addr)                                                \
+  ((ub4)(_addr) >= VMALLOC_START && (ub4)(_addr) < VMALLOC_END)
+
+/* --------------------------------------------------------------------------
+                         Export function declarations
+   -------------------------------------------------------------------------- */
+/* create a VMA of (at least) size bytes */
+vma_t *vma_create(ub4 size, ub4 flags);
+
+/* destroy a VMA, freeing the frames backing it */
+void vma_destroy(vma_t *vma);
+
+/* VMA holding addr, NULL if none */
+vma_t *vma_find(ub4 addr);
+
+/* back the page holding addr if it belongs to a VMA_DEMAND VMA */
+bool vma_fault(ub4 addr);
+
+/* reserve size bytes of lazily backed, zeroed memory */
+ub4 vm_reserve(ub4 size);
+
+/* release memory reserved by vm_reserve */
+void vm_release(ub4 addr);
+
+/* allocate size bytes of virtually contiguous, zeroed memory */
+void *vmalloc(ub4 size);
+
+/* release memory allocated by vmalloc */
+void vfree(void *addr);
+
+/* module init function   */
+bool vma_init_func(void);
+
+/* module exit function   */
+void vma_exit_func(void);
+
+#endif
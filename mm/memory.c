@@ -2,11 +2,22 @@
 
 #include "if/memory.h"
 #include "../common/if/common.h"
+#include "../common/if/cpu.h"
 
 /* -------------------------------------------------------------------------- 
                          Constants and types
    -------------------------------------------------------------------------- */ 
-ub4 free_mem_ptr = FREE_MEM_START;
+ub4          free_mem_ptr = FREE_MEM_START;
+bool         boot_mem_sealed = false;
+mem_region_t mem_regions[MAX_MEM_REGIONS];
+ub4          mem_regions_count = 0;
+
+static void memset_rep(ub1 *addr, ub4 len, ub1 val);
+static void memcpy_rep(ub1 *src, ub1 *dest, ub4 len);
+
+/* memset/memcpy implementations, see memory_init_func */
+void       (*memset_fn)(ub1 *addr, ub4 len, ub1 val)  = memset_rep;
+void       (*memcpy_fn)(ub1 *src, ub1 *dest, ub4 len) = memcpy_rep;
 
 /* -------------------------------------------------------------------------- 
                          Inline functions
@@ -18,10 +29,357 @@ page_align(ub4 addr)
   return (addr & 0xFFFFF000);
 }
 
+/* -------------------------------------------------------------------------- 
+                         Static functions
+   -------------------------------------------------------------------------- */ 
+/* 
+ * SF: add_mem_region - add a usable range to the (sorted) region list
+ * 
+ * ARGS :-
+ *   base - start of the range
+ *   len  - length of the range
+ *
+ * The range is clipped to MEM_MAX and shrunk to whole pages
+ *
+ * RET -
+ */
+static void
+add_mem_region(ub8 base, ub8 len)
+{
+  ub8 end = base + len;
+  ub4 start;
+  ub4 stop;
+  ub4 idx;
+
+  if (end > MEM_MAX)
+    end = MEM_MAX;
+
+  if (base >= end || mem_regions_count == MAX_MEM_REGIONS)
+    return;
+
+  start = page_align((ub4)base + PAGE_SIZE - 1);
+  stop  = page_align((ub4)end);
+  if (start >= stop)
+    return;
+
+  idx = mem_regions_count++;
+  while (idx && mem_regions[idx - 1].start_region > start) {
+    mem_regions[idx] = mem_regions[idx - 1];
+    idx--;
+  }
+
+  mem_regions[idx].start_region = start;
+  mem_regions[idx].end_region   = stop;
+}
+
+/* 
+ * SF: merge_mem_regions - merge overlapping and adjacent regions
+ * 
+ * ARGS :-
+ *
+ * RET -
+ */
+static void
+merge_mem_regions(void)
+{
+  ub4 idx;
+  ub4 out = 0;
+
+  if (!mem_regions_count)
+    return;
+
+  for (idx = 1; idx < mem_regions_count; idx++) {
+    if (mem_regions[idx].start_region <= mem_regions[out].end_region) {
+      if (mem_regions[idx].end_region > mem_regions[out].end_region)
+        mem_regions[out].end_region = mem_regions[idx].end_region;
+    }
+    else
+      mem_regions[++out] = mem_regions[idx];
+  }
+
+  mem_regions_count = out + 1;
+}
+
+/* 
+ * SF: memset_words - memset a word at a time
+ * 
+ * ARGS :-
+ *   addr - start address
+ *   len  - length
+ *   val  - val to set to
+ *
+ * RET -
+ */
+static void
+memset_words(ub1 *addr, ub4 len, ub1 val)
+{
+  ub4 pattern = (ub4)val * 0x01010101u;
+
+  while (len && ((ub4)addr & 3)) {
+    *addr++ = val;
+    len--;
+  }
+
+  for (; len >= sizeof(ub4); len -= sizeof(ub4), addr += sizeof(ub4))
+    *(ub4 *)addr = pattern;
+
+  while (len--)
+    *addr++ = val;
+}
+
+/* 
+ * SF: memcpy_words - memcpy a word at a time
+ * 
+ * ARGS :-
+ *   src  - source address
+ *   dest - destination address
+ *   len  - length
+ *
+ * Only dest is aligned, x86 is fine with unaligned loads
+ *
+ * RET -
+ */
+static void
+memcpy_words(ub1 *src, ub1 *dest, ub4 len)
+{
+  while (len && ((ub4)dest & 3)) {
+    *dest++ = *src++;
+    len--;
+  }
+
+  for (; len >= sizeof(ub4); len -= sizeof(ub4)) {
+    *(ub4 *)dest = *(ub4 *)src;
+    src  += sizeof(ub4);
+    dest += sizeof(ub4);
+  }
+
+  while (len--)
+    *dest++ = *src++;
+}
+
+/* 
+ * SF: memset_rep - memset with rep stosl
+ * 
+ * ARGS :-
+ *   addr - start address
+ *   len  - length
+ *   val  - val to set to
+ *
+ * Short ranges do not make up for the startup cost of rep
+ *
+ * RET -
+ */
+static void
+memset_rep(ub1 *addr, ub4 len, ub1 val)
+{
+  ub4 d0, d1;
+
+  if (len < MEM_REP_MIN) {
+    memset_words(addr, len, val);
+    return;
+  }
+
+  asm volatile("rep stosl; mov %4, %%ecx; rep stosb"
+               : "=&D" (d0), "=&c" (d1)
+               : "0" (addr), "1" (len >> 2), "d" (len & 3),
+                 "a" ((ub4)val * 0x01010101u)
+               : "memory");
+}
+
+/* 
+ * SF: memcpy_rep - memcpy with rep movsl
+ * 
+ * ARGS :-
+ *   src  - source address
+ *   dest - destination address
+ *   len  - length
+ *
+ * RET -
+ */
+static void
+memcpy_rep(ub1 *src, ub1 *dest, ub4 len)
+{
+  ub4 d0, d1, d2;
+
+  if (len < MEM_REP_MIN) {
+    memcpy_words(src, dest, len);
+    return;
+  }
+
+  asm volatile("rep movsl; mov %6, %%ecx; rep movsb"
+               : "=&S" (d0), "=&D" (d1), "=&c" (d2)
+               : "0" (src), "1" (dest), "2" (len >> 2), "d" (len & 3)
+               : "memory");
+}
+
+/* 
+ * SF: memset_sse2 - memset 64 bytes at a time with aligned SSE2 stores
+ * 
+ * ARGS :-
+ *   addr - start address
+ *   len  - length
+ *   val  - val to set to
+ *
+ * Interrupts are off while the xmm registers are in use, nothing saves them
+ * for us. A page fault on a store can't be held off, page_fault_handler
+ * saves them itself. The kernel is built without SSE, so the compiler never
+ * keeps anything in them and they are not listed as clobbered
+ *
+ * RET -
+ */
+static void
+memset_sse2(ub1 *addr, ub4 len, ub1 val)
+{
+  ub4 head;
+  ub4 d0, d1;
+
+  if (len < MEM_SSE_MIN) {
+    memset_rep(addr, len, val);
+    return;
+  }
+
+  head = (16 - ((ub4)addr & 15)) & 15;
+  memset_words(addr, head, val);
+  addr += head;
+  len  -= head;
+
+  asm volatile("pushfl; cli\n\t"
+               "movd %4, %%xmm0\n\t"
+               "pshufd $0, %%xmm0, %%xmm0\n"
+               "1:\n\t"
+               "movdqa %%xmm0, (%0)\n\t"
+               "movdqa %%xmm0, 16(%0)\n\t"
+               "movdqa %%xmm0, 32(%0)\n\t"
+               "movdqa %%xmm0, 48(%0)\n\t"
+               "add $64, %0\n\t"
+               "dec %1\n\t"
+               "jnz 1b\n\t"
+               "popfl"
+               : "=r" (d0), "=r" (d1)
+               : "0" (addr), "1" (len >> 6), "r" ((ub4)val * 0x01010101u)
+               : "memory", "cc");
+
+  memset_rep(addr + (len & ~63), len & 63, val);
+}
+
+/* 
+ * SF: memcpy_sse2 - memcpy 64 bytes at a time with SSE2
+ * 
+ * ARGS :-
+ *   src  - source address
+ *   dest - destination address
+ *   len  - length
+ *
+ * Stores are aligned, loads need not be. Interrupts are off while the xmm
+ * registers are in use (see memset_sse2 for faults)
+ *
+ * RET -
+ */
+static void
+memcpy_sse2(ub1 *src, ub1 *dest, ub4 len)
+{
+  ub4 head;
+  ub4 d0, d1, d2;
+
+  if (len < MEM_SSE_MIN) {
+    memcpy_rep(src, dest, len);
+    return;
+  }
+
+  head = (16 - ((ub4)dest & 15)) & 15;
+  memcpy_words(src, dest, head);
+  src  += head;
+  dest += head;
+  len  -= head;
+
+  asm volatile("pushfl; cli\n"
+               "1:\n\t"
+               "movdqu (%0), %%xmm0\n\t"
+               "movdqu 16(%0), %%xmm1\n\t"
+               "movdqu 32(%0), %%xmm2\n\t"
+               "movdqu 48(%0), %%xmm3\n\t"
+               "movdqa %%xmm0, (%1)\n\t"
+               "movdqa %%xmm1, 16(%1)\n\t"
+               "movdqa %%xmm2, 32(%1)\n\t"
+               "movdqa %%xmm3, 48(%1)\n\t"
+               "add $64, %0\n\t"
+               "add $64, %1\n\t"
+               "dec %2\n\t"
+               "jnz 1b\n\t"
+               "popfl"
+               : "=r" (d0), "=r" (d1), "=r" (d2)
+               : "0" (src), "1" (dest), "2" (len >> 6)
+               : "memory", "cc");
+
+  memcpy_rep(src + (len & ~63), dest + (len & ~63), len & 63);
+}
+
 /* -------------------------------------------------------------------------- 
                          Export functions
    -------------------------------------------------------------------------- */ 
 
+/* 
+ * EF: init_mem_map - build the usable region list from the BIOS memory map
+ * 
+ * ARGS :-
+ *   map - E820 map collected by the bootloader (may be empty)
+ *
+ * Only the usable entries are kept. If the BIOS gave us nothing, we assume
+ * MEM_SIZE bytes of memory like we always did
+ *
+ * RET -
+ */
+void
+init_mem_map(e820_map_t *map)
+{
+  ub4 idx;
+
+  mem_regions_count = 0;
+
+  if (map && map->count_e820 <= E820_MAX_ENTRIES) {
+    for (idx = 0; idx < map->count_e820; idx++) {
+      e820_entry_t *entry = &map->entries_e820[idx];
+
+      if (entry->type_e820 == E820_USABLE)
+        add_mem_region(entry->base_e820, entry->len_e820);
+    }
+  }
+
+  if (!mem_regions_count)
+    add_mem_region(FREE_MEM_START, MEM_SIZE - FREE_MEM_START);
+
+  merge_mem_regions();
+}
+
+/* 
+ * EF: get_mem_region_count - number of usable memory regions
+ * 
+ * ARGS :-
+ *
+ * RET -
+ *   region count
+ */
+ub4
+get_mem_region_count(void)
+{
+  return mem_regions_count;
+}
+
+/* 
+ * EF: get_mem_region - usable memory region idx
+ * 
+ * ARGS :-
+ *   idx - region index (regions are sorted by address)
+ *
+ * RET -
+ *   mem_region_t
+ */
+mem_region_t *
+get_mem_region(ub4 idx)
+{
+  return &mem_regions[idx];
+}
+
 /* 
  * EF: get_free_mem_ptr - return where the free mem ptr is
  * 
@@ -44,23 +402,57 @@ get_free_mem_ptr()
  *   align - should be aligned on page boundary 
  *
  * RET -
- *   reserved addr
+ *   reserved addr (in the direct map)
  */
 ub4 
 kmalloc_mem(ub4 size, bool align)
 {
   ub4 cur_mem_ptr;
 
+  if (boot_mem_sealed)
+    PANIC("Boot allocator sealed");
+
   if (align)
     free_mem_ptr = page_align(free_mem_ptr + PAGE_SIZE - 1);
 
-  if (free_mem_ptr >= (MEM_SIZE))
+  if (free_mem_ptr + size > BOOT_MAP_END)
     PANIC("No memory");
 
   cur_mem_ptr = free_mem_ptr;
   free_mem_ptr += size;
 
-  return cur_mem_ptr;
+  return PHYS_TO_VIRT(cur_mem_ptr);
+}
+
+/* 
+ * EF: seal_boot_mem - stop handing out boot memory
+ * 
+ * ARGS :-
+ *
+ * RET -
+ *   page aligned end of the memory reserved so far
+ */
+ub4
+seal_boot_mem(void)
+{
+  free_mem_ptr    = page_align(free_mem_ptr + PAGE_SIZE - 1);
+  boot_mem_sealed = true;
+
+  return free_mem_ptr;
+}
+
+/* 
+ * EF: is_boot_mem_sealed - has the boot allocator been sealed?
+ * 
+ * ARGS :-
+ *
+ * RET -
+ *   true once the frame allocator owns the rest of memory
+ */
+bool
+is_boot_mem_sealed(void)
+{
+  return boot_mem_sealed;
 }
 
 /* 
@@ -76,11 +468,7 @@ kmalloc_mem(ub4 size, bool align)
 void 
 memset(ub1 *addr, ub4 len, ub1 val)
 {
-  ub4 i = 0;
-  ub1 *temp = (ub1 *)addr;
-
-  for (i = 0; i < len; i++)
-    temp[i] = val;
+  memset_fn(addr, len, val);
 }
 
 /* 
@@ -88,16 +476,107 @@ memset(ub1 *addr, ub4 len, ub1 val)
  * 
  * ARGS :-
  *   src  - source address
- *   dest - destination address 
+ *   dest - destination address (must not overlap src, see memmove)
  *   len  - length
  *
  * RET -
  */
 void 
 memcpy(ub1 *src, ub1 *dest, ub4 len)
+{
+  memcpy_fn(src, dest, len);
+}
+
+/* 
+ * EF: memmove - copy 'len' bytes from source to dest, ranges may overlap
+ * 
+ * ARGS :-
+ *   src  - source address
+ *   dest - destination address
+ *   len  - length
+ *
+ * RET -
+ */
+void
+memmove(ub1 *src, ub1 *dest, ub4 len)
+{
+  ub4 d0, d1, d2;
+
+  /* Copying forwards is fine unless dest starts inside src */
+  if (dest <= src || dest >= src + len) {
+    memcpy_fn(src, dest, len);
+    return;
+  }
+
+  asm volatile("std; rep movsb; cld"
+               : "=&S" (d0), "=&D" (d1), "=&c" (d2)
+               : "0" (src + len - 1), "1" (dest + len - 1), "2" (len)
+               : "memory");
+}
+
+/* 
+ * EF: memcmp - compare 'len' bytes
+ * 
+ * ARGS :-
+ *   mem1 - first address
+ *   mem2 - second address
+ *   len  - length
+ *
+ * RET -
+ * less than 0 if mem1 < mem2, 
+ * equal to 0 if mem1 == mem2,
+ * greater than 0 otherwise
+ */
+sb4
+memcmp(ub1 *mem1, ub1 *mem2, ub4 len)
 {
   ub4 i = 0;
 
-  for (i = 0; i < len; i++)
-    dest[i] = src[i];
+  /* Skip the equal words, the first difference is found bytewise */
+  while (i + sizeof(ub4) <= len &&
+         *(ub4 *)(mem1 + i) == *(ub4 *)(mem2 + i))
+    i += sizeof(ub4);
+
+  for (; i < len; i++) {
+    if (mem1[i] != mem2[i])
+      return (sb4)mem1[i] - (sb4)mem2[i];
+  }
+
+  return 0;
+}
+
+/* 
+ * EF: memory_init_func - module init function
+ * 
+ * ARGS :-
+ *
+ * Picks the fastest memset/memcpy the CPU supports. Until then (and on CPUs
+ * without SSE2) the rep string versions are used
+ *
+ * RET - TRUE iff successful
+ */
+bool
+memory_init_func(void)
+{
+  if (cpu_sse_enabled()) {
+    memset_fn = memset_sse2;
+    memcpy_fn = memcpy_sse2;
+    printk_system("Initialized memory ops (sse2)..");
+  }
+  else
+    printk_system("Initialized memory ops (rep)..");
+
+  return true;
+}
+
+/* 
+ * EF: memory_exit_func - module exit function
+ * 
+ * ARGS :-
+ *
+ * RET -
+ */
+void
+memory_exit_func(void)
+{
 }
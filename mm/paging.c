@@ -2,14 +2,19 @@
 
 #include "if/paging.h"
 #include "if/memory.h"
+#include "if/frame.h"
+#include "if/vma.h"
 #include "../kernel/if/isr.h"
 #include "../drivers/if/screen.h"
 #include "../common/if/common.h"
+#include "../common/if/cpu.h"
 
 /* -------------------------------------------------------------------------- 
                          Constants and types
    -------------------------------------------------------------------------- */ 
-page_dir_t *cur_dir;
+page_dir_t   *cur_dir;
+ub4           page_table_frames; /* # frames holding page tables        */
+page_table_t *stale_tables;      /* emptied, wait for a full TLB flush  */
 
 /* -------------------------------------------------------------------------- 
                          Inline functions
@@ -56,6 +61,199 @@ clr_pte_bit(page_entry_t *pte, ub4 offset)
   *pte = (*pte & ~(1ULL << offset));
 }
 
+/* === SIF: Flush the TLB entry of a single page === */
+static inline void
+flush_tlb_page(ub4 addr)
+{
+  asm volatile("invlpg (%0)" :: "r" (addr) : "memory");
+}
+
+/* === SIF: Flush the whole TLB (reload CR3), global entries stay === */
+static inline void
+flush_tlb(void)
+{
+  ub4 cr3;
+
+  asm volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r" (cr3) :: "memory");
+}
+
+/* -------------------------------------------------------------------------- 
+                         Static functions
+   -------------------------------------------------------------------------- */ 
+/* 
+ * SF: add_large_page - Map a 4 MB page with a single directory entry
+ * 
+ * ARGS :-
+ *   virt_addr - virtual address (4 MB aligned)
+ *   phys_addr - physical address (4 MB aligned)
+ *   flags     - extra PDE bits (PTE_GLOBAL)
+ *   dir       - page directory
+ *
+ * RET
+ */
+static void
+add_large_page(ub4 virt_addr, ub4 phys_addr, ub4 flags, page_dir_t *dir)
+{
+  ub4 first_idx = (virt_addr >> PAGE_DIR_OFFSET) & PAGE_DIR_MASK;
+
+  ASSERT((!dir->tablesPhysical[first_idx]));
+  dir->tablesPhysical[first_idx] = phys_addr | PDE_LARGE | flags | 0x3;
+}
+
+/* 
+ * SF: alloc_page_table - Allocate a zeroed page table
+ * 
+ * ARGS :-
+ *
+ * The direct map is built before the frame allocator is up, its tables come
+ * out of the boot allocator (which only hands out memory the boot page
+ * tables already map). They are never freed, nothing in the direct map is
+ * ever unmapped
+ *
+ * RET
+ *   direct map address of the table, 0 if we are out of memory
+ */
+static ub4
+alloc_page_table(void)
+{
+  ub4 addr;
+
+  if (!is_boot_mem_sealed()) {
+    addr = kmalloc_mem(PAGE_SIZE, true);
+    memset((ub1 *)addr, PAGE_SIZE, 0);
+    page_table_frames++;
+    return addr;
+  }
+
+  addr = alloc_zeroed_frame();
+  if (!addr)
+    return 0;
+
+  page_table_frames++;
+  return PHYS_TO_VIRT(addr);
+}
+
+/* 
+ * SF: set_page_table_entry - Map a 4 KB page
+ * 
+ * ARGS :-
+ *   virt_addr - virtual address
+ *   phys_addr - physical address
+ *   flags     - extra PTE bits (PTE_GLOBAL)
+ *   dir       - page directory
+ *
+ * RET
+ */
+static void
+set_page_table_entry(ub4 virt_addr, ub4 phys_addr, ub4 flags,
+                     page_dir_t *dir)
+{
+  /* Find out which page table the address belongs to */
+  page_table_t *pt;
+  ub4           first_idx  = (virt_addr >> PAGE_DIR_OFFSET) & PAGE_DIR_MASK;
+  ub4           second_idx = (virt_addr >> PAGE_TABLE_OFFSET) & PAGE_TABLE_MASK;
+
+  /* Part of a 4 MB page, there is no page table to add to */
+  if (dir->tablesPhysical[first_idx] & PDE_LARGE)
+    PANIC("Mapping inside a large page");
+
+  /* If first level entry does not exist add it */
+  if(!dir->page_tables[first_idx])
+  {
+    ub4 sz = sizeof(page_table_t);
+
+    ASSERT((sz == PAGE_SIZE));
+    pt = (page_table_t *)alloc_page_table();
+    if (!pt)
+      PANIC("No memory for page table");
+
+    dir->page_tables[first_idx] = pt;
+    dir->tablesPhysical[first_idx] = (VIRT_TO_PHYS(pt) | 0x3);
+  }
+
+  /* Make sure there is no page table entry already */
+  pt = dir->page_tables[first_idx];
+  ASSERT((!get_pte_bit(&pt->page_entries[second_idx], PRESENT_OFFSET)));
+  pt->page_entries[second_idx] = phys_addr | flags | 0x3;
+  dir->tablesUsed[first_idx]++;
+}
+
+/* 
+ * SF: free_stale_tables - Free the page tables emptied since the last flush
+ * 
+ * ARGS :-
+ *
+ * Only once the whole TLB has been flushed
+ *
+ * RET
+ */
+static void
+free_stale_tables(void)
+{
+  page_table_t *pt;
+
+  while ((pt = stale_tables)) {
+    stale_tables        = (page_table_t *)pt->page_entries[0];
+    pt->page_entries[0] = 0;
+    free_frame(VIRT_TO_PHYS(pt));
+    page_table_frames--;
+  }
+}
+
+/* 
+ * SF: clear_page_table_entry - Clear a page table entry
+ * 
+ * ARGS :-
+ *   virt_addr - virtual address
+ *   dir       - page directory
+ *   flush     - invlpg the page (else the caller flushes the TLB)
+ *
+ * A page table whose last entry goes away is unhooked from the directory.
+ * With flush it is given back to the frame allocator right away. Without,
+ * the TLB may still cache the old directory entry, so the table waits on
+ * stale_tables until the caller flushes the whole TLB
+ *
+ * RET
+ *   phys addr the page was mapped to, 0 if it was not mapped
+ */
+static ub4
+clear_page_table_entry(ub4 virt_addr, page_dir_t *dir, bool flush)
+{
+  page_table_t *pt;
+  ub4           phys_addr;
+  ub4           first_idx  = (virt_addr >> PAGE_DIR_OFFSET) & PAGE_DIR_MASK;
+  ub4           second_idx = (virt_addr >> PAGE_TABLE_OFFSET) & PAGE_TABLE_MASK;
+
+  pt = dir->page_tables[first_idx];
+  if (!pt || !get_pte_bit(&pt->page_entries[second_idx], PRESENT_OFFSET))
+    return 0;
+
+  phys_addr = get_frame_addr(&pt->page_entries[second_idx]);
+  pt->page_entries[second_idx] = 0;
+  if (flush)
+    flush_tlb_page(virt_addr);
+
+  /* 
+   * The table is all zeroes again. Any stale translation through it is gone
+   * with the invlpg of its last entry
+   */
+  if (!--dir->tablesUsed[first_idx]) {
+    dir->page_tables[first_idx]    = NULL;
+    dir->tablesPhysical[first_idx] = 0;
+    if (flush) {
+      free_frame(VIRT_TO_PHYS(pt));
+      page_table_frames--;
+    }
+    else {
+      /* Chained through entry 0, a page aligned pointer is never present */
+      pt->page_entries[0] = (page_entry_t)stale_tables;
+      stale_tables        = pt;
+    }
+  }
+
+  return phys_addr;
+}
+
 /* -------------------------------------------------------------------------- 
                          Export functions
    -------------------------------------------------------------------------- */ 
@@ -65,16 +263,38 @@ clr_pte_bit(page_entry_t *pte, ub4 offset)
  * ARGS :-
  *   registers_t (see irq.h)
  *
+ * The fault may be taken by a store of memset_sse2/memcpy_sse2, which is
+ * retried with whatever the xmm registers hold when we return. Backing the
+ * page zeroes a frame, so the SSE state is saved around vma_fault
+ *
  * RET
  */
 void 
 page_fault_handler(registers_t regs)
 {
-  ub4 addr;
+  ub4  addr;
+  ub1  fx_buf[FXSAVE_SIZE + 16];
+  ub1 *fx_area = (ub1 *)(((ub4)fx_buf + 15) & ~15);
+  bool sse     = cpu_sse_enabled();
+  bool handled;
   
   /* Get the faulting address */
   asm volatile("mov %%cr2, %0" : "=r" (addr));
 
+  /* First touch of a demand paged VMA */
+  if (!(regs.err_code & 0x1)) {
+    if (sse)
+      fxsave(fx_area);
+
+    handled = vma_fault(addr);
+
+    if (sse)
+      fxrstor(fx_area);
+
+    if (handled)
+      return;
+  }
+
   printk("Page fault at: ");
   printk_num(addr);
   printk("\n");
@@ -106,38 +326,56 @@ void switch_page_dir(page_dir_t *dir)
 {
    ub4 cr0;
 
-   asm volatile("mov %0, %%cr3":: "r"(&dir->tablesPhysical));
+   asm volatile("mov %0, %%cr3":: "r"(VIRT_TO_PHYS(&dir->tablesPhysical)));
    asm volatile("mov %%cr0, %0": "=r"(cr0));
    cr0 |= 0x80000000; // Enable paging!
    asm volatile("mov %0, %%cr0":: "r"(cr0));
 }
 
 /* 
- * EF: kmalloc - Reserve memory and add page entry in cur_dir 
+ * EF: kmalloc - Reserve page granular memory
  * 
  * ARGS :-
  *   sz - size in bytes to reserve
  *
+ * All of physical memory is in the direct map (see paging_init_func), so
+ * the frames we hand out are already accessible. The memory is zeroed,
+ * single frames come out of the zero pool
+ *
  * RET
- *   starting phys addr of the reserved block
+ *   starting (direct map) addr of the reserved block
  */
 ub4
 kmalloc(ub4 sz)
 {
-  /* kmalloc_mem reserves a contigious block and returns the phys addr */
-  ub4 phys_addr, cur_addr;
+  ub4 phys_addr;
 
-  phys_addr = kmalloc_mem(sz, true);
-  
-  cur_addr = phys_addr;
-  while (cur_addr < (phys_addr + sz))
-  {
-    add_page_table_entry(cur_addr, cur_addr, cur_dir);
-    cur_addr += PAGE_SIZE;
+  if (sz <= PAGE_SIZE)
+    phys_addr = alloc_zeroed_frame();
+  else {
+    phys_addr = alloc_frames(size_to_order(sz));
+    if (phys_addr)
+      memset((ub1 *)PHYS_TO_VIRT(phys_addr), sz, 0);
   }
 
-  memset((ub1 *) phys_addr, sz, 0);
-  return phys_addr;
+  if (!phys_addr)
+    PANIC("No memory");
+
+  return PHYS_TO_VIRT(phys_addr);
+}
+
+/* 
+ * EF: kfree - Release memory reserved by kmalloc
+ * 
+ * ARGS :-
+ *   addr - address returned by kmalloc
+ *
+ * RET
+ */
+void
+kfree(ub4 addr)
+{
+  free_frames(VIRT_TO_PHYS(addr));
 }
 
 /* 
@@ -152,34 +390,126 @@ kmalloc(ub4 sz)
 void 
 add_page_table_entry(ub4 virt_addr, ub4 phys_addr, page_dir_t *dir)
 {
-  /* Find out which page table the address belongs to */
-  page_table_t *pt;
-  page_entry_t *pte;
-  ub4           first_idx  = (virt_addr >> PAGE_DIR_OFFSET) & PAGE_DIR_MASK;
-  ub4           second_idx = (virt_addr >> PAGE_TABLE_OFFSET) & PAGE_TABLE_MASK;
+  set_page_table_entry(virt_addr, phys_addr, 0, dir);
+}
 
-  /* If first level entry does not exist add it */
-  if(!dir->page_tables[first_idx])
-  {
-    ub4 i  = 0;
-    ub4 sz = sizeof(page_table_t);
+/* 
+ * EF: remove_page_table_entry - Remove page table entry
+ * 
+ * ARGS :-
+ *   virt_addr - virtual address
+ *   dir       - page directory
+ *
+ * RET
+ *   phys addr the page was mapped to, 0 if it was not mapped
+ */
+ub4
+remove_page_table_entry(ub4 virt_addr, page_dir_t *dir)
+{
+  return clear_page_table_entry(virt_addr, dir, true);
+}
+
+/* 
+ * EF: remove_page_range - Remove the page table entries of a range
+ * 
+ * ARGS :-
+ *   virt_addr - virtual address of the first page
+ *   npages    - # pages
+ *   dir       - page directory
+ *   flags     - UNMAP_FREE, UNMAP_NOFLUSH
+ *
+ * Up to INVLPG_MAX pages are flushed one at a time, a bigger range is
+ * cheaper to flush with a single CR3 reload at the end. Until that flush the
+ * TLB may still map the old frames, so they are gathered (UNMAP_GATHER at a
+ * time) and freed after it. With UNMAP_NOFLUSH nothing is flushed and the
+ * caller must not reuse the range before it calls flush_tlb_all
+ *
+ * RET
+ *   # pages that were mapped
+ */
+ub4
+remove_page_range(ub4 virt_addr, ub4 npages, page_dir_t *dir, ub4 flags)
+{
+  bool nofl     = !!(flags & UNMAP_NOFLUSH);
+  bool per_page = (!nofl && npages <= INVLPG_MAX);
+  bool gather   = (!nofl && !per_page && (flags & UNMAP_FREE));
+  ub4  frames[UNMAP_GATHER];
+  ub4  nframes  = 0;
+  ub4  removed  = 0;
+  ub4  phys_addr;
+  ub4  idx;
 
-    ASSERT(sz == PAGE_SIZE);
-    pt = (page_table_t *)kmalloc_mem(sz, true);
-    //memset((ub1 *)pt, sz, 0);
+  for (idx = 0; idx < npages; idx++, virt_addr += PAGE_SIZE) {
+    /* Skip over directory entries that have no table at all */
+    if (!dir->page_tables[(virt_addr >> PAGE_DIR_OFFSET) & PAGE_DIR_MASK]) {
+      ub4 skip = (LARGE_PAGE_SIZE - (virt_addr & (LARGE_PAGE_SIZE - 1))) /
+                 PAGE_SIZE;
 
-    dir->page_tables[first_idx] = pt;
-    dir->tablesPhysical[first_idx] = ((ub4)pt | 0x3);
+      idx       += skip - 1;
+      virt_addr += (skip - 1) * PAGE_SIZE;
+      continue;
+    }
+
+    phys_addr = clear_page_table_entry(virt_addr, dir, per_page);
+    if (!phys_addr)
+      continue;
+
+    removed++;
+    if (!(flags & UNMAP_FREE))
+      continue;
+
+    if (!gather) {
+      free_frame(phys_addr);
+      continue;
+    }
+
+    if (nframes == UNMAP_GATHER) {
+      flush_tlb();
+      while (nframes)
+        free_frame(frames[--nframes]);
+      free_stale_tables();
+    }
+    frames[nframes++] = phys_addr;
   }
 
-  /* Make sure there is no page table entry already */
-  pt = dir->page_tables[first_idx];
-  ASSERT(pt->page_entries[second_idx] == 2);
-  pt->page_entries[second_idx] = phys_addr | 0x3;
-  //pte = &pt->page_entries[second_idx];
-  //set_frame_addr(pte, phys_addr);
-  //set_pte_bit(pte, PRESENT_OFFSET);
-  //set_pte_bit(pte, RW_OFFSET);
+  if (!per_page && !nofl && removed) {
+    flush_tlb();
+    while (nframes)
+      free_frame(frames[--nframes]);
+    free_stale_tables();
+  }
+
+  return removed;
+}
+
+/* 
+ * EF: flush_tlb_all - Flush the whole TLB
+ * 
+ * ARGS :-
+ *
+ * Page tables left behind by UNMAP_NOFLUSH are freed now
+ *
+ * RET
+ */
+void
+flush_tlb_all(void)
+{
+  flush_tlb();
+  free_stale_tables();
+}
+
+/* 
+ * EF: get_page_table_frames - Number of frames holding page tables
+ * 
+ * ARGS :-
+ *
+ * RET
+ *   # page tables (the directory itself is not counted)
+ */
+ub4
+get_page_table_frames(void)
+{
+  return page_table_frames;
 }
 
 /* 
@@ -192,22 +522,60 @@ add_page_table_entry(ub4 virt_addr, ub4 phys_addr, page_dir_t *dir)
 bool
 paging_init_func()
 {
-  ub4 cur_addr = 0;
-  int idx      = 0;
-  ub4 sz       = sizeof(page_dir_t);
+  ub4  cur_addr = 0;
+  ub4  mem_end;
+  ub4  global   = 0;
+  ub4  nregions = get_mem_region_count();
+  ub4  sz       = sizeof(page_dir_t);
+  bool pse      = cpu_has(CPUID_EDX_PSE);
+
+  if (!nregions)
+    return false;
 
+  /* We run before the frame allocator, everything comes from boot memory */
+  mem_end = get_mem_region(nregions - 1)->end_region;
   cur_dir = (page_dir_t *)kmalloc_mem(sz, true);
   memset((ub1 *)cur_dir, sz, 0);
+
+  if (cpu_has(CPUID_EDX_PGE))
+    global = PTE_GLOBAL;
   
-  while (cur_addr < get_free_mem_ptr())
+  /* 
+   * Map all of physical memory from KERNEL_VIRT_BASE on. Page tables come
+   * out of the frame allocator, so any frame we hand out later must already
+   * be reachable. With PSE every whole 4 MB chunk is a single directory
+   * entry, which saves a page table per chunk and covers it with one TLB
+   * entry. Nothing is mapped below KERNEL_VIRT_BASE, the boot stub's
+   * identity map goes away with the switch
+   */
+  if (pse) {
+    cpu_set_cr4(CR4_PSE);
+    while (cur_addr + LARGE_PAGE_SIZE <= mem_end) {
+      add_large_page(PHYS_TO_VIRT(cur_addr), cur_addr, global, cur_dir);
+      cur_addr += LARGE_PAGE_SIZE;
+    }
+  }
+
+  /* Whatever is left over (or everything, without PSE) gets 4 KB pages */
+  while (cur_addr < mem_end)
   {
-    add_page_table_entry(cur_addr, cur_addr, cur_dir);
+    set_page_table_entry(PHYS_TO_VIRT(cur_addr), cur_addr, global, cur_dir);
     cur_addr += PAGE_SIZE;
   }
   
   register_handler(14, page_fault_handler);
-  printk_system("Initialized paging..");
   switch_page_dir(cur_dir);
+
+  /* Global entries only take effect now, and survive every later switch */
+  if (global)
+    cpu_set_cr4(CR4_PGE);
+
+  if (pse)
+    printk_system("Initialized paging (4 MB pages)..");
+  else
+    printk_system("Initialized paging..");
+
+  return true;
 }
 
 /* 
@@ -0,0 +1,407 @@
+/* KalioOS (C) 2020 Pranav Bagur */
+
+#include "if/slab.h"
+#include "if/frame.h"
+#include "../common/if/common.h"
+
+/* --------------------------------------------------------------------------
+                         Constants and types
+   -------------------------------------------------------------------------- */
+/* The cache kmem_cache_t objects themselves come from */
+kmem_cache_t  cache_cache;
+list          kmem_caches;
+ub4           kmem_caches_count;
+shrinker_t    kmem_shrinker;
+
+/* --------------------------------------------------------------------------
+                         Static inline functions
+   -------------------------------------------------------------------------- */
+/* === SIF: Round val up to a multiple of align (power of 2) === */
+static inline ub4
+kmem_align(ub4 val, ub4 align)
+{
+  return ((val + align - 1) & ~(align - 1));
+}
+
+/* === SIF: Size of a slab in bytes === */
+static inline ub4
+slab_bytes(kmem_cache_t *cache)
+{
+  return (PAGE_SIZE << cache->order_cache);
+}
+
+/* === SIF: Slab holding obj === */
+static inline slab_t *
+obj_to_slab(kmem_cache_t *cache, void *obj)
+{
+  return (slab_t *)((ub4)obj & ~(slab_bytes(cache) - 1));
+}
+
+/* === SIF: Address of object idx in a slab === */
+static inline void *
+slab_obj(kmem_cache_t *cache, slab_t *slab, ub4 idx)
+{
+  return (void *)((ub4)slab + cache->offset_cache + idx * cache->size_cache);
+}
+
+/* --------------------------------------------------------------------------
+                         Static functions
+   -------------------------------------------------------------------------- */
+/*
+ * SF: kmem_cache_init - set up the geometry of a cache
+ *
+ * ARGS :-
+ *   cache - cache to initialize
+ *   name  - name of the cache
+ *   size  - object size
+ *   align - object alignment (power of 2, 0 for the default)
+ *   ctor  - constructor, may be NULL
+ *
+ * Picks the smallest slab order that fits KMEM_MIN_OBJS objects
+ *
+ * RET
+ *   true iff at least one object fits in a slab
+ */
+static bool
+kmem_cache_init(kmem_cache_t *cache, ub1 *name, ub4 size, ub4 align,
+                kmem_ctor_t ctor)
+{
+  ub4 idx;
+  ub4 order;
+  ub4 nobjs = 0;
+  ub4 offset = 0;
+
+  if (align < KMEM_MIN_ALIGN)
+    align = KMEM_MIN_ALIGN;
+
+  memset((ub1 *)cache, sizeof(*cache), 0);
+  for (idx = 0; idx < KMEM_NAME_LEN - 1 && name[idx]; idx++)
+    cache->name_cache[idx] = name[idx];
+
+  cache->size_cache  = kmem_align(size ? size : 1, align);
+  cache->align_cache = align;
+  cache->ctor_cache  = ctor;
+
+  for (order = 0; order <= KMEM_MAX_SLAB_ORDER; order++) {
+    ub4 bytes = (PAGE_SIZE << order);
+
+    nobjs = (bytes - sizeof(slab_t)) / (cache->size_cache + sizeof(ub2));
+    if (nobjs > KMEM_SLAB_END - 1)
+      nobjs = KMEM_SLAB_END - 1;
+
+    /* Aligning the first object may push the last one out */
+    while (nobjs) {
+      offset = kmem_align(sizeof(slab_t) + nobjs * sizeof(ub2), align);
+      if (offset + nobjs * cache->size_cache <= bytes)
+        break;
+      nobjs--;
+    }
+
+    if (nobjs >= KMEM_MIN_OBJS)
+      break;
+  }
+
+  if (order > KMEM_MAX_SLAB_ORDER)
+    order = KMEM_MAX_SLAB_ORDER;
+
+  if (!nobjs)
+    return false;
+
+  cache->order_cache         = order;
+  cache->objs_per_slab_cache = nobjs;
+  cache->offset_cache        = offset;
+
+  list_init(&cache->partial_slabs_cache);
+  list_init(&cache->full_slabs_cache);
+  list_init(&cache->empty_slabs_cache);
+  return true;
+}
+
+/*
+ * SF: kmem_cache_grow - add a new slab to a cache
+ *
+ * ARGS :-
+ *   cache - cache to grow
+ *
+ * The new slab goes on the empty list, every object is constructed
+ *
+ * RET
+ *   true iff successful
+ */
+static bool
+kmem_cache_grow(kmem_cache_t *cache)
+{
+  slab_t *slab;
+  ub4     idx;
+  ub4     addr;
+
+  addr = alloc_frames(cache->order_cache);
+  if (!addr)
+    return false;
+
+  slab = (slab_t *)PHYS_TO_VIRT(addr);
+
+  slab->cache_slab  = cache;
+  slab->in_use_slab = 0;
+  slab->free_slab   = 0;
+
+  for (idx = 0; idx < cache->objs_per_slab_cache; idx++) {
+    slab->next_slab[idx] = idx + 1;
+    if (cache->ctor_cache)
+      cache->ctor_cache(slab_obj(cache, slab, idx));
+  }
+  slab->next_slab[cache->objs_per_slab_cache - 1] = KMEM_SLAB_END;
+
+  list_add_head(&cache->empty_slabs_cache, &slab->link_slab);
+  cache->empty_count_cache++;
+  cache->total_objs_cache += cache->objs_per_slab_cache;
+
+  return true;
+}
+
+/*
+ * SF: kmem_slab_destroy - free an empty slab
+ *
+ * ARGS :-
+ *   cache - owning cache
+ *   slab  - slab (already off the cache lists)
+ *
+ * RET
+ */
+static void
+kmem_slab_destroy(kmem_cache_t *cache, slab_t *slab)
+{
+  ASSERT((slab->in_use_slab == 0));
+
+  cache->total_objs_cache -= cache->objs_per_slab_cache;
+  free_frames(VIRT_TO_PHYS(slab));
+}
+
+/*
+ * SF: kmem_shrink - slab shrinker
+ *
+ * ARGS :-
+ *
+ * Frees the empty slabs of every cache
+ *
+ * RET
+ */
+static void
+kmem_shrink(void)
+{
+  list *cur;
+
+  list_for_each(cur, &kmem_caches)
+    kmem_cache_shrink(list_entry(cur, kmem_cache_t, link_cache));
+}
+
+/* --------------------------------------------------------------------------
+                         Export functions
+   -------------------------------------------------------------------------- */
+/*
+ * EF: kmem_cache_create - create an object cache
+ *
+ * ARGS :-
+ *   name  - name of the cache
+ *   size  - object size
+ *   align - object alignment (power of 2, 0 for the default)
+ *   ctor  - constructor run once per object when its slab is created
+ *
+ * RET
+ *   cache, NULL on failure
+ */
+kmem_cache_t *
+kmem_cache_create(ub1 *name, ub4 size, ub4 align, kmem_ctor_t ctor)
+{
+  kmem_cache_t *cache;
+
+  cache = (kmem_cache_t *)kmem_cache_alloc(&cache_cache);
+  if (!cache)
+    return NULL;
+
+  if (!kmem_cache_init(cache, name, size, align, ctor)) {
+    kmem_cache_free(&cache_cache, cache);
+    return NULL;
+  }
+
+  list_add_tail(&kmem_caches, &cache->link_cache);
+  kmem_caches_count++;
+  return cache;
+}
+
+/*
+ * EF: kmem_cache_alloc - allocate an object from a cache
+ *
+ * ARGS :-
+ *   cache - cache to allocate from
+ *
+ * RET
+ *   constructed object, NULL if we are out of memory
+ */
+void *
+kmem_cache_alloc(kmem_cache_t *cache)
+{
+  slab_t *slab;
+  ub4     idx;
+
+  if (!cache->partial_count_cache) {
+    list *item;
+
+    if (!cache->empty_count_cache && !kmem_cache_grow(cache))
+      return NULL;
+
+    item = list_remove_front(&cache->empty_slabs_cache);
+    cache->empty_count_cache--;
+
+    list_add_head(&cache->partial_slabs_cache, item);
+    cache->partial_count_cache++;
+  }
+
+  slab = list_entry(cache->partial_slabs_cache.next, slab_t, link_slab);
+  ASSERT((slab->free_slab != KMEM_SLAB_END));
+
+  idx             = slab->free_slab;
+  slab->free_slab = slab->next_slab[idx];
+  slab->in_use_slab++;
+  cache->in_use_objs_cache++;
+
+  if (slab->in_use_slab == cache->objs_per_slab_cache) {
+    list_remove(&cache->partial_slabs_cache, &slab->link_slab);
+    cache->partial_count_cache--;
+
+    list_add_head(&cache->full_slabs_cache, &slab->link_slab);
+    cache->full_count_cache++;
+  }
+
+  return slab_obj(cache, slab, idx);
+}
+
+/*
+ * EF: kmem_cache_free - return an object to its cache
+ *
+ * ARGS :-
+ *   cache - owning cache
+ *   obj   - object, in its constructed state
+ *
+ * RET
+ */
+void
+kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+  slab_t *slab = obj_to_slab(cache, obj);
+  ub4     idx;
+
+  ASSERT((slab->cache_slab == cache));
+  idx = ((ub4)obj - (ub4)slab - cache->offset_cache) / cache->size_cache;
+
+  if (slab->in_use_slab == cache->objs_per_slab_cache) {
+    list_remove(&cache->full_slabs_cache, &slab->link_slab);
+    cache->full_count_cache--;
+
+    list_add_head(&cache->partial_slabs_cache, &slab->link_slab);
+    cache->partial_count_cache++;
+  }
+
+  slab->next_slab[idx] = slab->free_slab;
+  slab->free_slab      = idx;
+  slab->in_use_slab--;
+  cache->in_use_objs_cache--;
+
+  if (!slab->in_use_slab) {
+    list_remove(&cache->partial_slabs_cache, &slab->link_slab);
+    cache->partial_count_cache--;
+
+    if (cache->empty_count_cache >= KMEM_MAX_EMPTY_SLABS) {
+      kmem_slab_destroy(cache, slab);
+      return;
+    }
+
+    list_add_head(&cache->empty_slabs_cache, &slab->link_slab);
+    cache->empty_count_cache++;
+  }
+}
+
+/*
+ * EF: kmem_cache_shrink - release the empty slabs of a cache
+ *
+ * ARGS :-
+ *   cache - cache to shrink
+ *
+ * RET
+ *   number of frames released
+ */
+ub4
+kmem_cache_shrink(kmem_cache_t *cache)
+{
+  ub4 freed = 0;
+
+  while (cache->empty_count_cache) {
+    list *item = list_remove_front(&cache->empty_slabs_cache);
+
+    cache->empty_count_cache--;
+    kmem_slab_destroy(cache, list_entry(item, slab_t, link_slab));
+    freed += (1 << cache->order_cache);
+  }
+
+  return freed;
+}
+
+/*
+ * EF: kmem_cache_destroy - destroy a cache
+ *
+ * ARGS :-
+ *   cache - cache to destroy, all of its objects must have been freed
+ *
+ * RET
+ */
+void
+kmem_cache_destroy(kmem_cache_t *cache)
+{
+  ASSERT((cache->in_use_objs_cache == 0));
+
+  kmem_cache_shrink(cache);
+  list_remove(&kmem_caches, &cache->link_cache);
+  kmem_caches_count--;
+  kmem_cache_free(&cache_cache, cache);
+}
+
+/*
+ * EF: slab_init_func - module init function
+ *
+ * ARGS :-
+ *
+ * RET - TRUE iff successful
+ */
+bool
+slab_init_func(void)
+{
+  list_init(&kmem_caches);
+  kmem_caches_count = 0;
+
+  if (!kmem_cache_init(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0,
+                       NULL))
+    return false;
+
+  list_add_tail(&kmem_caches, &cache_cache.link_cache);
+  kmem_caches_count++;
+
+  kmem_shrinker.name_shrinker = "slab";
+  kmem_shrinker.func_shrinker = kmem_shrink;
+  kmem_shrinker.prio_shrinker = SHRINK_PRIO_CACHE;
+  register_shrinker(&kmem_shrinker);
+
+  printk_system("Initialized slab caches..");
+  return true;
+}
+
+/*
+ * EF: slab_exit_func - module exit function
+ *
+ * ARGS :-
+ *
+ * RET
+ */
+void
+slab_exit_func(void)
+{
+}
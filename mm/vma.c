@@ -0,0 +1,357 @@
+/* KalioOS (C) 2020 Pranav Bagur */
+
+#include "if/vma.h"
+#include "if/frame.h"
+#include "if/paging.h"
+#include "if/slab.h"
+#include "if/heap.h"
+#include "../common/if/common.h"
+
+/* --------------------------------------------------------------------------
+                         Constants and types
+   -------------------------------------------------------------------------- */
+vma_area_t   *vma_glob;
+kmem_cache_t *vma_cache;
+
+/* --------------------------------------------------------------------------
+                         Static functions
+   -------------------------------------------------------------------------- */
+/*
+ * SF: vma_unmap - free the frames backing a VMA
+ *
+ * ARGS :-
+ *   vma   - VMA to unmap
+ *   flags - 0 or UNMAP_NOFLUSH
+ *
+ * RET
+ */
+static void
+vma_unmap(vma_t *vma, ub4 flags)
+{
+  ub4 unmapped;
+
+  if (!vma->pages_vma)
+    return;
+
+  unmapped = remove_page_range(vma->start_vma,
+                               (vma->end_vma - vma->start_vma) / PAGE_SIZE,
+                               cur_dir, UNMAP_FREE | flags);
+  vma->pages_vma         -= unmapped;
+  vma_glob->pages_area   -= unmapped;
+}
+
+/*
+ * SF: vma_purge_lazy - flush the TLB and destroy every VMA_LAZY VMA
+ *
+ * ARGS :-
+ *
+ * RET
+ *   true iff anything was purged
+ */
+static bool
+vma_purge_lazy(void)
+{
+  list  *cur;
+  list  *next;
+  vma_t *vma;
+
+  if (!vma_glob->lazy_area)
+    return false;
+
+  /* Their pages are already unmapped, this retires the stale entries */
+  flush_tlb_all();
+
+  for (cur = vma_glob->vmas_area.next; cur; cur = next) {
+    next = cur->next;
+    vma  = list_entry(cur, vma_t, link_vma);
+    if (vma->flags_vma & VMA_LAZY)
+      vma_destroy(vma);
+  }
+
+  vma_glob->lazy_area = 0;
+  return true;
+}
+
+/* --------------------------------------------------------------------------
+                         Export functions
+   -------------------------------------------------------------------------- */
+/*
+ * EF: vma_create - create a virtual memory area
+ *
+ * ARGS :-
+ *   size  - size in bytes (rounded up to pages)
+ *   flags - VMA_DEMAND
+ *
+ * First fit over the (sorted) VMA list, leaving a guard page after every VMA
+ *
+ * RET
+ *   vma, NULL if the VMALLOC region is full
+ */
+vma_t *
+vma_create(ub4 size, ub4 flags)
+{
+  vma_t *vma;
+  vma_t *next;
+  list  *cur;
+  ub4    start;
+
+  size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+  if (!size || size > VMALLOC_END - VMALLOC_START)
+    return NULL;
+
+retry:
+  next  = NULL;
+  start = VMALLOC_START;
+  list_for_each(cur, &vma_glob->vmas_area) {
+    next = list_entry(cur, vma_t, link_vma);
+    if (next->start_vma - start >= size + PAGE_SIZE)
+      break;
+
+    start = next->end_vma + PAGE_SIZE;
+    next  = NULL;
+  }
+
+  if (!next && VMALLOC_END - start < size + PAGE_SIZE) {
+    if (vma_purge_lazy())
+      goto retry;
+    return NULL;
+  }
+
+  vma = (vma_t *)kmem_cache_alloc(vma_cache);
+  if (!vma)
+    return NULL;
+
+  vma->start_vma = start;
+  vma->end_vma   = start + size;
+  vma->flags_vma = flags;
+  vma->pages_vma = 0;
+
+  /* Keep the list sorted, we go in front of the VMA that stopped the scan */
+  if (next)
+    list_add_before(&next->link_vma, &vma->link_vma);
+  else
+    list_add_tail(&vma_glob->vmas_area, &vma->link_vma);
+
+  vma_glob->count_area++;
+  return vma;
+}
+
+/*
+ * EF: vma_destroy - destroy a virtual memory area
+ *
+ * ARGS :-
+ *   vma - VMA to destroy
+ *
+ * RET
+ */
+void
+vma_destroy(vma_t *vma)
+{
+  vma_unmap(vma, 0);
+
+  list_remove(&vma_glob->vmas_area, &vma->link_vma);
+  vma_glob->count_area--;
+  kmem_cache_free(vma_cache, vma);
+}
+
+/*
+ * EF: vma_find - find the VMA holding an address
+ *
+ * ARGS :-
+ *   addr - virtual address
+ *
+ * RET
+ *   vma, NULL if addr is not in any live VMA (guard pages included)
+ */
+vma_t *
+vma_find(ub4 addr)
+{
+  list  *cur;
+  vma_t *vma;
+
+  if (!vma_glob || !IS_VMALLOC_ADDR(addr))
+    return NULL;
+
+  list_for_each(cur, &vma_glob->vmas_area) {
+    vma = list_entry(cur, vma_t, link_vma);
+    if (addr < vma->start_vma)
+      break;
+
+    if (addr < vma->end_vma)
+      return ((vma->flags_vma & VMA_LAZY) ? NULL : vma);
+  }
+
+  return NULL;
+}
+
+/*
+ * EF: vma_fault - back a page of a demand VMA
+ *
+ * ARGS :-
+ *   addr - faulting address
+ *
+ * Called from page_fault_handler for not present faults
+ *
+ * RET
+ *   true iff the fault was handled and the access can be retried
+ */
+bool
+vma_fault(ub4 addr)
+{
+  vma_t *vma = vma_find(addr);
+  ub4    phys;
+
+  if (!vma || !(vma->flags_vma & VMA_DEMAND))
+    return false;
+
+  phys = alloc_zeroed_frame();
+  if (!phys) {
+    printk("Out of memory backing a demand page\n");
+    return false;
+  }
+
+  add_page_table_entry(addr & ~(PAGE_SIZE - 1), phys, cur_dir);
+  vma->pages_vma++;
+  vma_glob->pages_area++;
+  vma_glob->faults_area++;
+  return true;
+}
+
+/*
+ * EF: vm_reserve - reserve lazily backed memory
+ *
+ * ARGS :-
+ *   size - size in bytes
+ *
+ * Nothing is allocated until a page is touched, and it reads as zero then
+ *
+ * RET
+ *   virtual address, 0 on failure
+ */
+ub4
+vm_reserve(ub4 size)
+{
+  vma_t *vma = vma_create(size, VMA_DEMAND);
+
+  return (vma ? vma->start_vma : 0);
+}
+
+/*
+ * EF: vm_release - release memory reserved by vm_reserve
+ *
+ * ARGS :-
+ *   addr - address returned by vm_reserve
+ *
+ * RET
+ */
+void
+vm_release(ub4 addr)
+{
+  vma_t *vma = vma_find(addr);
+
+  ASSERT((vma && vma->start_vma == addr));
+  vma_destroy(vma);
+}
+
+/*
+ * EF: vmalloc - allocate virtually contiguous memory
+ *
+ * ARGS :-
+ *   size - size in bytes
+ *
+ * Every page is mapped right away with a frame of its own, so this works
+ * for as long as there are free frames, however fragmented
+ *
+ * RET
+ *   zeroed memory, NULL on failure
+ */
+void *
+vmalloc(ub4 size)
+{
+  vma_t *vma = vma_create(size, 0);
+  ub4    addr;
+  ub4    phys;
+
+  if (!vma)
+    return NULL;
+
+  for (addr = vma->start_vma; addr < vma->end_vma; addr += PAGE_SIZE) {
+    phys = alloc_zeroed_frame();
+    if (!phys) {
+      /* Nothing has used the new mappings yet, a plain destroy will do */
+      vma_destroy(vma);
+      return NULL;
+    }
+
+    add_page_table_entry(addr, phys, cur_dir);
+    vma->pages_vma++;
+    vma_glob->pages_area++;
+  }
+
+  return (void *)vma->start_vma;
+}
+
+/*
+ * EF: vfree - release memory allocated by vmalloc
+ *
+ * ARGS :-
+ *   addr - address returned by vmalloc
+ *
+ * The frames go back right away, the TLB flush (and so the address range)
+ * waits until enough has been freed lazily
+ *
+ * RET
+ */
+void
+vfree(void *addr)
+{
+  vma_t *vma = vma_find((ub4)addr);
+  ub4    pages;
+
+  ASSERT((vma && vma->start_vma == (ub4)addr));
+  ASSERT((!(vma->flags_vma & VMA_DEMAND)));
+
+  pages = (vma->end_vma - vma->start_vma) / PAGE_SIZE;
+  vma_unmap(vma, UNMAP_NOFLUSH);
+  vma->flags_vma      |= VMA_LAZY;
+  vma_glob->lazy_area += pages;
+
+  if (vma_glob->lazy_area >= VMA_LAZY_MAX)
+    vma_purge_lazy();
+}
+
+/*
+ * EF: vma_init_func - module init function
+ *
+ * ARGS :-
+ *
+ * RET - TRUE iff successful
+ */
+bool
+vma_init_func(void)
+{
+  vma_cache = kmem_cache_create("vma", sizeof(vma_t), 0, NULL);
+  if (!vma_cache)
+    return false;
+
+  vma_glob = (vma_area_t *)kmalloc_heap(sizeof(*vma_glob));
+  if (!vma_glob)
+    return false;
+
+  list_init(&vma_glob->vmas_area);
+
+  printk_system("Initialized virtual memory areas..");
+  return true;
+}
+
+/*
+ * EF: vma_exit_func - module exit function
+ *
+ * ARGS :-
+ *
+ * RET
+ */
+void
+vma_exit_func(void)
+{
+}
@@ -7,7 +7,12 @@
 #include "../../common/if/list.h"
 #include "../../mm/if/paging.h"
 #include "../../mm/if/heap.h"
+#include "../../mm/if/frame.h"
+#include "../../mm/if/slab.h"
+#include "../../mm/if/vma.h"
+#include "../../mm/if/arena.h"
 #include "../../drivers/if/timer.h"
+#include "../../drivers/if/clock.h"
 #include "../../common/if/ring_buffer.h"
 
 /* -------------------------------------------------------------------------- 
@@ -31,18 +36,42 @@ void test_cpu_fault(void);
 /* page allocation and fault */
 void test_page_fault(void);
 
+/* demand paged reservation */
+void test_demand_paging(void);
+
+/* vmalloc/vfree */
+void test_vmalloc(void);
+
 /* list add/remove and loop */
 void test_list(void);
 
+/* frame alloc split free coalesce */
+void test_frames(void);
+
+/* shrinkers run before frame allocation fails */
+void test_shrinker(void);
+
+/* memset memcpy memmove memcmp */
+void test_memory(void);
+
 /* heap malloc free grow shrink */
 void test_heap(void);
 
+/* object cache alloc free ctor */
+void test_slab(void);
+
+/* arena alloc reset destroy */
+void test_arena(void);
+
 /* timer callback */
 void timer_callback(ub8 data);
 
 /* test timer dyn */
 void test_timer(void);
 
+/* test clocksource */
+void test_clock(void);
+
 /* test lock code */
 void test_lock(void);
 
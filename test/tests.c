@@ -5,6 +5,13 @@
 #include "../common/if/lock_intr.h"
 #include "../common/if/ring_buffer.h"
 
+/* -------------------------------------------------------------------------- 
+                         Constants and types
+   -------------------------------------------------------------------------- */ 
+#define TEST_SLAB_MAGIC 0x5AB5AB
+
+ub4 test_shrink_frame;
+
 /* -------------------------------------------------------------------------- 
                          Export functions
    -------------------------------------------------------------------------- */ 
@@ -40,6 +47,91 @@ test_page_fault()
   do_page_fault = *(ptr2 + 0x1); /* page fault here */
 }
 
+/* 
+ * EF: test_demand_paging - demand paged reservation
+ * 
+ * ARGS :-
+ *
+ * RET -
+ */
+void
+test_demand_paging()
+{
+  ub4    addr;
+  ub4    idx;
+  ub4    pages = 256;
+  vma_t *vma;
+
+  /* A 1 MB reservation costs no frames until it is touched */
+  addr = vm_reserve(pages * PAGE_SIZE);
+  ASSERT(addr);
+  vma = vma_find(addr);
+  ASSERT((vma && vma->pages_vma == 0));
+
+  /* Only the touched pages get a (zeroed) frame */
+  ASSERT((*(ub4 *)addr == 0));
+  *(ub4 *)(addr + 10 * PAGE_SIZE) = 0x1234;
+  ASSERT((*(ub4 *)(addr + (pages - 1) * PAGE_SIZE) == 0));
+  ASSERT((*(ub4 *)(addr + 10 * PAGE_SIZE) == 0x1234));
+  ASSERT((vma->pages_vma == 3));
+
+  /* Bulk (SSE2) stores that fault keep their data */
+  memset((ub1 *)(addr + 20 * PAGE_SIZE), PAGE_SIZE, 0x5A);
+  memcpy((ub1 *)(addr + 20 * PAGE_SIZE), (ub1 *)(addr + 21 * PAGE_SIZE),
+         PAGE_SIZE);
+  for (idx = 0; idx < PAGE_SIZE; idx += 64)
+    ASSERT((*(ub1 *)(addr + 21 * PAGE_SIZE + idx) == 0x5A));
+  ASSERT((vma->pages_vma == 5));
+
+  /* Past the end is the guard page */
+  ASSERT(!vma_find(addr + pages * PAGE_SIZE));
+
+  vm_release(addr);
+  ASSERT(!vma_find(addr));
+
+  /* With nothing else mapped there, the page table went back too */
+  if (!vma_glob->count_area)
+    ASSERT((!cur_dir->page_tables[addr >> 22]));
+}
+
+/* 
+ * EF: test_vmalloc - vmalloc/vfree
+ * 
+ * ARGS :-
+ *
+ * RET -
+ */
+void
+test_vmalloc()
+{
+  ub4    pages = 64;
+  ub4    idx;
+  ub1   *buf;
+  ub1   *buf2;
+  vma_t *vma;
+
+  /* All pages are backed up front, and zeroed */
+  buf = (ub1 *)vmalloc(pages * PAGE_SIZE);
+  ASSERT(buf);
+  vma = vma_find((ub4)buf);
+  ASSERT((vma && vma->pages_vma == pages));
+
+  for (idx = 0; idx < pages; idx++) {
+    ASSERT((buf[idx * PAGE_SIZE] == 0));
+    buf[idx * PAGE_SIZE] = (ub1)idx;
+  }
+
+  for (idx = 0; idx < pages; idx++)
+    ASSERT((buf[idx * PAGE_SIZE] == (ub1)idx));
+
+  /* A lazily freed range is not handed out again before the flush */
+  vfree(buf);
+  ASSERT(!vma_find((ub4)buf));
+  buf2 = (ub1 *)vmalloc(PAGE_SIZE);
+  ASSERT((buf2 && buf2 != buf));
+  vfree(buf2);
+}
+
 /* 
  * EF: test_list - list add/remove and loop
  * 
@@ -87,6 +179,161 @@ test_list()
   }
 }
 
+/* 
+ * EF: test_frames - frame alloc/split/free/coalesce
+ * 
+ * ARGS :-
+ *
+ * RET -
+ */
+void
+test_frames()
+{
+  ub4 free_before;
+  ub4 single;
+  ub4 block;
+  ub4 other;
+
+  /* The idle loop fills the zero pool, start from a known state */
+  drain_zero_pool();
+  free_before = get_free_frames();
+  single      = alloc_frame();
+  block       = alloc_frames(3);
+  other       = alloc_frames(3);
+
+  ASSERT((single && block && other));
+  ASSERT(((block & ((PAGE_SIZE << 3) - 1)) == 0));
+  ASSERT(frame_in_use(block + PAGE_SIZE));
+  ASSERT((get_free_frames() == free_before - 17));
+
+  free_frame(single);
+  free_frames(block);
+  free_frames(other);
+
+  ASSERT(!frame_in_use(block));
+  ASSERT((get_free_frames() == free_before));
+
+  /* Everything coalesced back, so we get the same block again */
+  ASSERT((alloc_frames(3) == block));
+  free_frames(block);
+
+  /* Zero pool frames come back zeroed, draining it restores the count */
+  fill_zero_pool();
+  single = alloc_zeroed_frame();
+  ASSERT((single && *(ub4 *)PHYS_TO_VIRT(single) == 0));
+  free_frame(single);
+  drain_zero_pool();
+  ASSERT((get_free_frames() == free_before));
+
+  printk_num(get_free_frames());
+  printk(" frames free\n");
+}
+
+/* === SIF: test_shrinker callback, gives up the frame it holds === */
+static void
+test_shrink(void)
+{
+  if (test_shrink_frame) {
+    free_frame(test_shrink_frame);
+    test_shrink_frame = 0;
+  }
+}
+
+/* 
+ * EF: test_shrinker - shrinkers run before frame allocation fails
+ * 
+ * ARGS :-
+ *
+ * RET -
+ */
+void
+test_shrinker()
+{
+  shrinker_t shrinker;
+  ub4        head = 0;
+  ub4        addr;
+  ub4        runs = get_shrink_runs();
+
+  shrinker.name_shrinker = "test";
+  shrinker.func_shrinker = test_shrink;
+  shrinker.prio_shrinker = SHRINK_PRIO_USER;
+  register_shrinker(&shrinker);
+
+  /* Run the frame allocator dry, chaining the frames through themselves */
+  test_shrink_frame = alloc_frame();
+  while ((addr = alloc_frame())) {
+    *(ub4 *)PHYS_TO_VIRT(addr) = head;
+    head = addr;
+  }
+
+  ASSERT((get_shrink_runs() > runs));
+  ASSERT((shrinker.calls_shrinker && shrinker.freed_shrinker));
+  ASSERT((test_shrink_frame == 0));
+  ASSERT((get_free_frames() == 0));
+
+  while (head) {
+    addr = *(ub4 *)PHYS_TO_VIRT(head);
+    free_frame(head);
+    head = addr;
+  }
+
+  unregister_shrinker(&shrinker);
+}
+
+/* 
+ * EF: test_memory - memset/memcpy/memmove/memcmp across sizes and alignments
+ * 
+ * ARGS :-
+ *
+ * RET -
+ */
+void
+test_memory()
+{
+  ub4  lens[] = {0, 1, 3, 17, 63, 64, 255, 256, 1000, 3000};
+  ub4  idx;
+  ub4  off;
+  ub4  i;
+  ub1 *src = (ub1 *)kmalloc_heap_flags(2 * PAGE_SIZE, HEAP_NOZERO);
+  ub1 *dst = (ub1 *)kmalloc_heap_flags(2 * PAGE_SIZE, HEAP_NOZERO);
+
+  ASSERT((src && dst));
+
+  for (i = 0; i < 2 * PAGE_SIZE; i++)
+    src[i] = (ub1)(i * 7);
+
+  for (idx = 0; idx < ARRAY_SIZE(lens); idx++) {
+    for (off = 0; off < 4; off++) {
+      memset(dst, 2 * PAGE_SIZE, 0xAA);
+      memset(dst + off, lens[idx], 0x5C);
+      ASSERT((dst[off + lens[idx]] == 0xAA));
+      for (i = 0; i < lens[idx]; i++)
+        ASSERT((dst[off + i] == 0x5C));
+
+      memcpy(src + 3, dst + off, lens[idx]);
+      ASSERT((memcmp(src + 3, dst + off, lens[idx]) == 0));
+      ASSERT((dst[off + lens[idx]] == 0xAA));
+    }
+  }
+
+  /* Overlapping both ways */
+  memcpy(src, dst, 2 * PAGE_SIZE);
+  memmove(dst + 8, dst + 13, 3000);
+  ASSERT((memcmp(src + 8, dst + 13, 3000) == 0));
+
+  memcpy(src, dst, 2 * PAGE_SIZE);
+  memmove(dst + 13, dst + 8, 3000);
+  ASSERT((memcmp(src + 13, dst + 8, 3000) == 0));
+
+  memcpy(src, dst, 200);
+  src[100] = 1;
+  dst[100] = 2;
+  ASSERT((memcmp(src, dst, 200) < 0));
+
+  kfree_heap((ub4 *)src);
+  kfree_heap((ub4 *)dst);
+}
+
 /* 
  * EF: test_heap - heap malloc/free/grow
  * 
@@ -100,19 +347,116 @@ test_heap()
   ub4 idx = 0;
   ub4 max = 100;
   ub4 *addrs[max];
+  ub4 live;
+  ub4 in_use;
+  ub4 allocs;
+  ub4 frees;
+
+  /* Churning one chunk keeps reusing the cached bundle */
+  addrs[0] = (ub4 *)kmalloc_heap(20);
+  allocs   = addr_to_bundle(addrs[0])->tub_bundle->allocs_tub;
+  frees    = addr_to_bundle(addrs[0])->tub_bundle->frees_tub;
+  kfree_heap(addrs[0]);
 
   for (idx = 0; idx < max; idx++) {
     ub4 *addr = (ub4 *)kmalloc_heap(20);
+#ifdef HEAP_HARDEN
+    /* ... but not the chunk itself, it is poisoned and in quarantine */
+    ASSERT((addr != addrs[0]));
+    ASSERT((*(ub1 *)addrs[0] == HEAP_POISON_BYTE));
+#else
+    ASSERT((addr == addrs[0]));
+#endif
     kfree_heap(addr);
   }
 
+  /* ... and shows up in the counters meminfo prints */
+  ASSERT((addr_to_bundle(addrs[0])->tub_bundle->allocs_tub == allocs + max));
+  ASSERT((addr_to_bundle(addrs[0])->tub_bundle->frees_tub == frees + max + 1));
+
   for (idx = 0; idx < max; idx++) {
     addrs[idx] = (ub4 *)kmalloc_heap(20);
+    ASSERT((((ub4)addrs[idx] & (HEAP_ALIGN - 1)) == 0));
   }
 
+  /* Chunks have no header, the bundle is found from the address */
+  ASSERT((addr_to_bundle(addrs[0])->magic_bundle == MAGIC_BUNDLE));
+#ifdef HEAP_HARDEN
+  ASSERT((addr_to_bundle(addrs[0])->tub_bundle->size_tub == 40));
+#else
+  ASSERT((addr_to_bundle(addrs[0])->tub_bundle->size_tub == 24));
+#endif
+
+  /* Every chunk in use, but not parked in a magazine, is charged */
+  for (idx = 0, live = 0; idx < HEAP_PROF_SITES; idx++)
+    live += heap_glob->sites_heap[idx].live_bytes_site;
+  for (idx = 0, in_use = 0; idx < N_TUBS; idx++)
+    in_use += (heap_glob->tubs[idx].total_in_use_tub -
+               heap_glob->tubs[idx].cached_tub) *
+              heap_glob->tubs[idx].size_tub;
+  ASSERT((live == in_use));
+
   for (idx = 0; idx < max; idx++) {
     kfree_heap(addrs[idx]);
   }
+
+  /* Freed chunks sit in magazines until they are reaped */
+  ASSERT((addr_to_bundle(addrs[0])->tub_bundle->cached_tub));
+  heap_mag_reap();
+  ASSERT((addr_to_bundle(addrs[0])->tub_bundle->cached_tub == 0));
+  ASSERT((heap_glob->mags_heap == 0));
+
+  /* Large allocations are whole frames with no chunk header */
+  for (idx = 0; idx < 10; idx++) {
+    addrs[idx] = (ub4 *)kmalloc_heap(PAGE_SIZE * (idx + 1) + 20);
+    ASSERT((((ub4)addrs[idx] & (PAGE_SIZE - 1)) == 0));
+  }
+
+  for (idx = 0; idx < 10; idx++) {
+    kfree_heap(addrs[idx]);
+  }
+}
+
+/* === SIF: test_slab constructor === */
+static void
+test_slab_ctor(void *obj)
+{
+  *(ub4 *)obj = TEST_SLAB_MAGIC;
+}
+
+/* 
+ * EF: test_slab - object cache alloc/free/ctor
+ * 
+ * ARGS :-
+ *
+ * RET -
+ */
+void
+test_slab()
+{
+  ub4           idx;
+  ub4           max = 100;
+  ub4          *objs[max];
+  kmem_cache_t *cache;
+
+  cache = kmem_cache_create("test", 40, 8, test_slab_ctor);
+  ASSERT(cache);
+
+  for (idx = 0; idx < max; idx++) {
+    objs[idx] = (ub4 *)kmem_cache_alloc(cache);
+    ASSERT((*objs[idx] == TEST_SLAB_MAGIC));
+    ASSERT((((ub4)objs[idx] & 7) == 0));
+  }
+
+  for (idx = 0; idx < max; idx++)
+    kmem_cache_free(cache, objs[idx]);
+
+  /* Freed objects come back constructed, not zeroed */
+  objs[0] = (ub4 *)kmem_cache_alloc(cache);
+  ASSERT((*objs[0] == TEST_SLAB_MAGIC));
+  kmem_cache_free(cache, objs[0]);
+
+  kmem_cache_destroy(cache);
 }
 
 /* 
@@ -130,6 +474,46 @@ timer_callback(ub8 data)
   printk("\n");
 }
 
+/* 
+ * EF: test_arena - arena alloc/reset/destroy
+ * 
+ * ARGS :-
+ *
+ * RET -
+ */
+void
+test_arena()
+{
+  arena_t arena;
+  ub1    *first;
+  ub1    *addr;
+  ub4     idx;
+  ub4     free_before = get_free_frames();
+
+  arena_init(&arena);
+  ASSERT((arena_alloc(&arena, ARENA_MAX_ALLOC + 1) == NULL));
+
+  /* Bumped, aligned and spilling over into a second block */
+  first = (ub1 *)arena_alloc(&arena, 13);
+  addr  = (ub1 *)arena_alloc(&arena, 13);
+  ASSERT((first && addr == first + 16));
+  for (idx = 0; idx < 2 * PAGE_SIZE / 64; idx++) {
+    addr = (ub1 *)arena_alloc(&arena, 64);
+    ASSERT((addr && ((ub4)addr & (ARENA_ALIGN - 1)) == 0));
+  }
+  ASSERT((arena.blocks_count_arena == 3));
+
+  /* A reset reuses the same blocks */
+  arena_reset(&arena);
+  ASSERT((arena_alloc(&arena, 13) == first));
+  for (idx = 0; idx < 2 * PAGE_SIZE / 64; idx++)
+    arena_alloc(&arena, 64);
+  ASSERT((arena.blocks_count_arena == 3));
+
+  arena_destroy(&arena);
+  ASSERT((get_free_frames() == free_before));
+}
+
 /* 
  * EF: test_timer - test delay code
  * 
@@ -140,7 +524,60 @@ timer_callback(ub8 data)
 void
 test_timer()
 {
-  timer_t *timer = add_dyn_timer(60, &timer_callback, 5);
+  timer_t  own_timer;
+  ub4      pending = get_pending_timers();
+  timer_t *timer   = add_dyn_timer(60, &timer_callback, 5);
+
+  /* Due within a turn of the root wheel */
+  ASSERT((timer && get_pending_timers() == pending + 1));
+  ASSERT((timer->head_timer == &timer_glob->root_wheel[
+            (ub4)timer->expires_timer & TIMER_ROOT_MASK]));
+
+  /* Cancelled before it fires, and the callback never runs */
+  ASSERT((del_dyn_timer(timer) && get_pending_timers() == pending));
+
+  /* A caller owned timer can be moved, cancelled and armed again */
+  setup_dyn_timer(&own_timer, &timer_callback, 6, 0);
+  ASSERT((!mod_dyn_timer(&own_timer, 1000)));
+  ASSERT((mod_dyn_timer(&own_timer, 10)));
+  ASSERT((get_pending_timers() == pending + 1));
+  ASSERT((del_dyn_timer(&own_timer) && !del_dyn_timer(&own_timer)));
+  ASSERT((own_timer.head_timer == NULL));
+  ASSERT((get_pending_timers() == pending));
+}
+
+/* 
+ * EF: test_clock - test clocksource
+ * 
+ * ARGS :-
+ *
+ * RET -
+ */
+void
+test_clock()
+{
+  ub8 start       = ktime_get_ns();
+  ub8 start_ticks = ticks;
+  ub8 prev        = start;
+  ub8 now;
+  ub4 khz;
+
+  ASSERT((ns_to_ticks(0) == 0 && ns_to_ticks(1) == 1));
+  ASSERT((ns_to_ticks(ticks_to_ns(5)) == 5));
+  ASSERT((ns_to_ticks(ticks_to_ns(5) + 1) == 6));
+
+  /* Never goes back, and agrees with the tick */
+  do {
+    now = ktime_get_ns();
+    ASSERT((now >= prev));
+    prev = now;
+  } while (now - start < ticks_to_ns(4));
+  ASSERT((ticks - start_ticks >= 1));
+
+  printk(clock_name(&khz));
+  printk(" clock at ");
+  printk_num(khz);
+  printk(" kHz\n");
 }
 
 /* 
@@ -154,14 +591,24 @@ void
 test_lock()
 {
   ub8 flags;
+  ub8 inner;
   ub8 var = 102134335;
 
   printk("looping\n");
   while(var--);
   var = 1021343355;
   printk("locking\n");
-  lock_intr(&flags);
+  ASSERT((lock_intr(&flags)));
   while(var--);
+
+  /* Nested, interrupts stay off until the outer unlock */
+  ASSERT((!lock_intr(&inner)));
+  unlock_intr(&inner);
+  ASSERT((!lock_intr(&inner)));
+  unlock_intr(&inner);
+  unlock_intr(&flags);
+
+  ASSERT((lock_intr(&flags)));
   unlock_intr(&flags);
   printk("unlocked\n");
 }